@@ -3,6 +3,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <gelf.h>
@@ -12,6 +13,35 @@
 #include "asm/insn.h"
 #include "common.h"
 
+__thread FILE *logfp;
+
+/* redirect the calling thread's log output into a memory buffer */
+void log_buffer_start(struct log_buffer *log)
+{
+	memset(log, 0, sizeof(*log));
+	log->fp = open_memstream(&log->buf, &log->size);
+	if (!log->fp)
+		ERROR("open_memstream");
+	logfp = log->fp;
+}
+
+void log_buffer_stop(struct log_buffer *log)
+{
+	logfp = NULL;
+	if (fclose(log->fp))
+		ERROR("fclose");
+	log->fp = NULL;
+}
+
+/* write out and release the output collected by a stopped log buffer */
+void log_buffer_flush(struct log_buffer *log)
+{
+	if (log->size && fwrite(log->buf, log->size, 1, stdout) != 1)
+		ERROR("fwrite");
+	free(log->buf);
+	memset(log, 0, sizeof(*log));
+}
+
 int is_rela_section(struct section *sec)
 {
 	return (sec->sh.sh_type == SHT_RELA);
@@ -66,6 +96,30 @@ struct symbol *find_symbol_by_name(struct list_head *list, const char *name)
 	return NULL;
 }
 
+/*
+ * Get the data of a section.  Compressed sections, from objects built with
+ * -gz or output with --debug-info=compress, are decompressed first and their
+ * header updated to match.
+ */
+static Elf_Data *kpatch_get_section_data(struct section *sec, Elf_Scn *scn)
+{
+	Elf_Data *data;
+
+	if (sec->sh.sh_flags & SHF_COMPRESSED) {
+		if (elf_compress(scn, 0, 0) < 0)
+			ERROR("elf_compress: %s: %s", sec->name,
+			      elf_errmsg(-1));
+		if (!gelf_getshdr(scn, &sec->sh))
+			ERROR("gelf_getshdr");
+	}
+
+	data = elf_getdata(scn, NULL);
+	if (!data)
+		ERROR("elf_getdata");
+
+	return data;
+}
+
 static void kpatch_create_section_list(struct kpatch_elf *kelf)
 {
 	Elf_Scn *scn = NULL;
@@ -100,12 +154,22 @@ static void kpatch_create_section_list(struct kpatch_elf *kelf)
 		if (!sec->name)
 			ERROR("elf_strptr");
 
-		sec->data = elf_getdata(scn, NULL);
-		if (!sec->data)
-			ERROR("elf_getdata");
-
 		sec->index = elf_ndxscn(scn);
 
+		/*
+		 * The .debug_* sections and their relas are usually the bulk
+		 * of the object but are only needed for the output, so defer
+		 * reading them until kpatch_elf_load_section().
+		 */
+		if (!strncmp(sec->name, ".debug_", 7) ||
+		    !strncmp(sec->name, ".rela.debug_", 12)) {
+			log_debug("ndx %02d, deferred, size %lu, name %s\n",
+				sec->index, sec->sh.sh_size, sec->name);
+			continue;
+		}
+
+		sec->data = kpatch_get_section_data(sec, scn);
+
 		log_debug("ndx %02d, data %p, size %zu, name %s\n",
 			sec->index, sec->data->d_buf, sec->data->d_size,
 			sec->name);
@@ -296,13 +360,9 @@ void rela_insn(struct section *sec, struct rela *rela, struct insn *insn)
 	}
 }
 
-static void kpatch_create_rela_list(struct kpatch_elf *kelf,
+static void kpatch_link_rela_section(struct kpatch_elf *kelf,
 				     struct section *sec)
 {
-	int rela_nr, index = 0, skip = 0;
-	struct rela *rela;
-	unsigned int symndx;
-
 	/* find matching base (text/data) section */
 	sec->base = find_section_by_name(&kelf->sections, sec->name + 5);
 	if (!sec->base)
@@ -310,9 +370,24 @@ static void kpatch_create_rela_list(struct kpatch_elf *kelf,
 
 	/* create reverse link from base section to this rela section */
 	sec->base->rela = sec;
+}
+
+static void kpatch_create_rela_list(struct kpatch_elf *kelf,
+				     struct section *sec)
+{
+	int rela_nr, index = 0, skip = 0;
+	struct rela *rela;
+	unsigned int symndx;
+	GElf_Rela r;
 
 	rela_nr = sec->sh.sh_size / sec->sh.sh_entsize;
 
+	sec->relas = malloc(rela_nr * sizeof(*sec->relas));
+	if (!sec->relas && rela_nr)
+		ERROR("malloc");
+	memset(sec->relas, 0, rela_nr * sizeof(*sec->relas));
+	sec->nr_relas = rela_nr;
+
 	log_debug("\n=== rela list for %s (%d entries) ===\n",
 		sec->base->name, rela_nr);
 
@@ -323,21 +398,22 @@ static void kpatch_create_rela_list(struct kpatch_elf *kelf,
 
 	/* read and store the rela entries */
 	while (rela_nr--) {
-		ALLOC_LINK(rela, &sec->relas);
+		rela = &sec->relas[index];
 
-		if (!gelf_getrela(sec->data, index, &rela->rela))
+		if (!gelf_getrela(sec->data, index, &r))
 			ERROR("gelf_getrela");
 		index++;
 
-		rela->type = GELF_R_TYPE(rela->rela.r_info);
-		rela->addend = rela->rela.r_addend;
-		rela->offset = rela->rela.r_offset;
-		symndx = GELF_R_SYM(rela->rela.r_info);
+		rela->type = GELF_R_TYPE(r.r_info);
+		rela->addend = r.r_addend;
+		rela->offset = r.r_offset;
+		symndx = GELF_R_SYM(r.r_info);
 		rela->sym = find_symbol_by_index(&kelf->symbols, symndx);
 		if (!rela->sym)
 			ERROR("could not find rela entry symbol\n");
 		if (rela->sym->sec &&
 		    (rela->sym->sec->sh.sh_flags & SHF_STRINGS)) {
+			kpatch_elf_load_section(kelf, rela->sym->sec);
 			/* XXX This differs from upstream. Send a pull request. */
 			rela->string = rela->sym->sec->data->d_buf +
 				       rela->sym->sym.st_value + rela->addend;
@@ -382,6 +458,32 @@ static void kpatch_create_rela_list(struct kpatch_elf *kelf,
 	}
 }
 
+/*
+ * Read the data of a section whose loading was deferred by
+ * kpatch_create_section_list() and, for a rela section, its rela entries.
+ * Does nothing if the section has already been loaded.
+ */
+void kpatch_elf_load_section(struct kpatch_elf *kelf, struct section *sec)
+{
+	Elf_Scn *scn;
+
+	if (sec->data)
+		return;
+
+	if (!kelf->elf)
+		ERROR("section %s was not loaded with the cached model",
+		      sec->name);
+
+	scn = elf_getscn(kelf->elf, sec->index);
+	if (!scn)
+		ERROR("elf_getscn");
+
+	sec->data = kpatch_get_section_data(sec, scn);
+
+	if (is_rela_section(sec))
+		kpatch_create_rela_list(kelf, sec);
+}
+
 struct kpatch_elf *kpatch_elf_open(const char *name)
 {
 	Elf *elf;
@@ -408,15 +510,22 @@ struct kpatch_elf *kpatch_elf_open(const char *name)
 	/* read and store section, symbol entries from file */
 	kelf->elf = elf;
 	kelf->fd = fd;
+	if (!gelf_getehdr(elf, &kelf->ehdr))
+		ERROR("gelf_getehdr");
 	kpatch_create_section_list(kelf);
 	kpatch_create_symbol_list(kelf);
 
-	/* for each rela section, read and store the rela entries */
+	/*
+	 * For each rela section, read and store the rela entries.  The
+	 * deferred .rela.debug_* sections are only linked to their base
+	 * section here.
+	 */
 	list_for_each_entry(sec, &kelf->sections, list) {
 		if (!is_rela_section(sec))
 			continue;
-		INIT_LIST_HEAD(&sec->relas);
-		kpatch_create_rela_list(kelf, sec);
+		kpatch_link_rela_section(kelf, sec);
+		if (sec->data)
+			kpatch_create_rela_list(kelf, sec);
 	}
 
 	return kelf;
@@ -433,14 +542,16 @@ void kpatch_elf_teardown(struct kpatch_elf *kelf)
 {
 	struct section *sec, *safesec;
 	struct symbol *sym, *safesym;
-	struct rela *rela, *saferela;
+
+	/* the elements of a cached model are freed with its mapping */
+	if (kelf->map)
+		goto out;
 
 	list_for_each_entry_safe(sec, safesec, &kelf->sections, list) {
 		if (is_rela_section(sec)) {
-			list_for_each_entry_safe(rela, saferela, &sec->relas, list) {
-				memset(rela, 0, sizeof(*rela));
-				free(rela);
-			}
+			memset(sec->relas, 0,
+			       sec->nr_relas * sizeof(*sec->relas));
+			free(sec->relas);
 			memset(sec, 0, sizeof(*sec));
 			free(sec);
 		}
@@ -451,25 +562,117 @@ void kpatch_elf_teardown(struct kpatch_elf *kelf)
 		free(sym);
 	}
 
+out:
 	INIT_LIST_HEAD(&kelf->sections);
 	INIT_LIST_HEAD(&kelf->symbols);
 }
 
+/*
+ * Copy the names and section data that still point into the Elf object the
+ * elements were read from, so that the Elf object can be freed while kelf is
+ * still in use.  This is meant for the output kpatch_elf, which only holds
+ * the elements that are written out.
+ *
+ * The rela string pointers are only used for comparing the objects and are
+ * cleared rather than copied.
+ */
+void kpatch_elf_detach(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	struct symbol *sym;
+	struct rela *rela;
+	Elf_Data *data;
+
+	list_for_each_entry(sec, &kelf->sections, list) {
+		sec->name = strdup(sec->name);
+		if (!sec->name)
+			ERROR("strdup");
+
+		data = malloc(sizeof(*data));
+		if (!data)
+			ERROR("malloc");
+		*data = *sec->data;
+		if (sec->data->d_buf) {
+			data->d_buf = malloc(data->d_size);
+			if (!data->d_buf && data->d_size)
+				ERROR("malloc");
+			memcpy(data->d_buf, sec->data->d_buf, data->d_size);
+		}
+		sec->data = data;
+
+		if (is_rela_section(sec))
+			for_each_rela(rela, sec)
+				rela->string = NULL;
+	}
+
+	list_for_each_entry(sym, &kelf->symbols, list) {
+		if (sym->type == STT_SECTION && sym->sec) {
+			sym->name = sym->sec->name;
+			continue;
+		}
+		sym->name = strdup(sym->name);
+		if (!sym->name)
+			ERROR("strdup");
+	}
+}
+
 void kpatch_elf_free(struct kpatch_elf *kelf)
 {
+	if (kelf->map)
+		munmap(kelf->map, kelf->map_size);
 	elf_end(kelf->elf);
 	close(kelf->fd);
 	memset(kelf, 0, sizeof(*kelf));
 	free(kelf);
 }
 
-void kpatch_write_output_elf(struct kpatch_elf *kelf,
-			      Elf *elf, char *outfile)
+/*
+ * Parse the argument of a --debug-info option, returns -1 if it isn't
+ * valid.
+ */
+int kpatch_parse_debug_info(const char *arg)
+{
+	if (!strcmp(arg, "keep"))
+		return DEBUG_INFO_KEEP;
+	if (!strcmp(arg, "strip"))
+		return DEBUG_INFO_STRIP;
+	if (!strcmp(arg, "compress") || !strcmp(arg, "compress=zlib"))
+		return DEBUG_INFO_ZLIB;
+#ifdef ELFCOMPRESS_ZSTD
+	if (!strcmp(arg, "compress=zstd"))
+		return DEBUG_INFO_ZSTD;
+#endif
+	if (!strcmp(arg, "split"))
+		return DEBUG_INFO_SPLIT;
+	return -1;
+}
+
+/* The ELFCOMPRESS_* type to write the debug sections with, or 0 */
+int kpatch_debug_info_compression(int debug_info)
+{
+	switch (debug_info) {
+	case DEBUG_INFO_ZLIB:
+		return ELFCOMPRESS_ZLIB;
+#ifdef ELFCOMPRESS_ZSTD
+	case DEBUG_INFO_ZSTD:
+		return ELFCOMPRESS_ZSTD;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Write kelf to outfile.  If compress is an ELFCOMPRESS_* type, the
+ * .debug_* sections are written compressed with it.
+ */
+void kpatch_write_output_elf(struct kpatch_elf *kelf, char *outfile,
+			     int compress)
 {
 	int fd;
 	struct section *sec;
 	Elf *elfout;
-	GElf_Ehdr eh, ehout;
+	GElf_Ehdr *eh = &kelf->ehdr, ehout;
 	Elf_Scn *scn;
 	Elf_Data *data;
 	GElf_Shdr sh;
@@ -483,22 +686,23 @@ void kpatch_write_output_elf(struct kpatch_elf *kelf,
 	if (!elfout)
 		ERROR("elf_begin");
 
-	if (!gelf_newehdr(elfout, gelf_getclass(kelf->elf)))
+	if (!gelf_newehdr(elfout, eh->e_ident[EI_CLASS]))
 		ERROR("gelf_newehdr");
 
 	if (!gelf_getehdr(elfout, &ehout))
 		ERROR("gelf_getehdr");
 
-	if (!gelf_getehdr(elf, &eh))
-		ERROR("gelf_getehdr");
-
 	memset(&ehout, 0, sizeof(ehout));
-	ehout.e_ident[EI_DATA] = eh.e_ident[EI_DATA];
-	ehout.e_machine = eh.e_machine;
-	ehout.e_type = eh.e_type;
+	ehout.e_ident[EI_DATA] = eh->e_ident[EI_DATA];
+	ehout.e_machine = eh->e_machine;
+	ehout.e_type = eh->e_type;
 	ehout.e_version = EV_CURRENT;
 	ehout.e_shstrndx = find_section_by_name(&kelf->sections, ".shstrtab")->index;
 
+	/* elf_compress() needs the byte order to write the headers in */
+	if (!gelf_update_ehdr(elfout, &ehout))
+		ERROR("gelf_update_ehdr");
+
 	/* add changed sections */
 	list_for_each_entry(sec, &kelf->sections, list) {
 		scn = elf_newscn(elfout);
@@ -523,10 +727,12 @@ void kpatch_write_output_elf(struct kpatch_elf *kelf,
 
 		if (!gelf_update_shdr(scn, &sh))
 			ERROR("gelf_update_shdr");
-	}
 
-	if (!gelf_update_ehdr(elfout, &ehout))
-		ERROR("gelf_update_ehdr");
+		if (compress && is_debug_section(sec) &&
+		    !is_rela_section(sec) && sec->data->d_size &&
+		    elf_compress(scn, compress, 0) < 0)
+			ERROR("elf_compress: %s: %s", sec->name, elf_errmsg(-1));
+	}
 
 	if (elf_update(elfout, ELF_C_WRITE) < 0) {
 		printf("%s\n",elf_errmsg(-1));
@@ -552,7 +758,7 @@ void kpatch_dump_kelf(struct kpatch_elf *kelf)
 			if (is_debug_section(sec))
 				goto next;
 			printf("rela section expansion\n");
-			list_for_each_entry(rela, &sec->relas, list) {
+			for_each_rela(rela, sec) {
 				printf("sym %d, offset %d, type %d, %s %s %d\n",
 				       rela->sym->index, rela->offset,
 				       rela->type, rela->sym->name,
@@ -734,16 +940,33 @@ void kpatch_create_symtab(struct kpatch_elf *kelf)
 	symtab->sh.sh_info = nr_local;
 }
 
+void kpatch_reindex_elements(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	struct symbol *sym;
+	int index;
+
+	index = 1; /* elf write function handles NULL section 0 */
+	list_for_each_entry(sec, &kelf->sections, list)
+		sec->index = index++;
+
+	index = 0;
+	list_for_each_entry(sym, &kelf->symbols, list) {
+		sym->index = index++;
+		if (sym->sec)
+			sym->sym.st_shndx = sym->sec->index;
+		else if (sym->sym.st_shndx != SHN_ABS)
+			sym->sym.st_shndx = SHN_UNDEF;
+	}
+}
+
 void kpatch_rebuild_rela_section_data(struct section *sec)
 {
 	struct rela *rela;
-	int nr = 0, index = 0, size;
+	int index = 0, size;
 	GElf_Rela *relas;
 
-	list_for_each_entry(rela, &sec->relas, list)
-		nr++;
-
-	size = nr * sizeof(*relas);
+	size = sec->nr_relas * sizeof(*relas);
 	relas = malloc(size);
 	if (!relas)
 		ERROR("malloc");
@@ -754,14 +977,10 @@ void kpatch_rebuild_rela_section_data(struct section *sec)
 
 	sec->sh.sh_size = size;
 
-	list_for_each_entry(rela, &sec->relas, list) {
+	for_each_rela(rela, sec) {
 		relas[index].r_offset = rela->offset;
 		relas[index].r_addend = rela->addend;
 		relas[index].r_info = GELF_R_INFO(rela->sym->index, rela->type);
 		index++;
 	}
-
-	/* sanity check, index should equal nr */
-	if (index != nr)
-		ERROR("size mismatch in rebuilt rela section");
 }
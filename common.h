@@ -20,7 +20,7 @@ extern char *childobj;
 #define log(level, format, ...) \
 ({ \
 	if (loglevel <= (level)) \
-		printf(format, ##__VA_ARGS__); \
+		fprintf(logfp ? logfp : stdout, format, ##__VA_ARGS__); \
 })
 
 #define ALLOC_LINK(_new, _list) \
@@ -40,6 +40,23 @@ enum loglevel {
 
 extern enum loglevel loglevel;
 
+/*
+ * Log output of worker threads is collected in a log_buffer and written out
+ * by the caller once the thread is done, so that the output is always in the
+ * same order no matter how the threads were scheduled.
+ */
+extern __thread FILE *logfp;
+
+struct log_buffer {
+	char *buf;
+	size_t size;
+	FILE *fp;
+};
+
+void log_buffer_start(struct log_buffer *log);
+void log_buffer_stop(struct log_buffer *log);
+void log_buffer_flush(struct log_buffer *log);
+
 /*******************
  * Data structures
  * ****************/
@@ -67,7 +84,8 @@ struct section {
 	union {
 		struct { /* if (is_rela_section()) */
 			struct section *base;
-			struct list_head relas;
+			struct rela *relas;
+			unsigned int nr_relas;
 		};
 		struct { /* else */
 			struct section *rela;
@@ -91,16 +109,23 @@ struct symbol {
 	};
 };
 
+/*
+ * The relas of a section are stored in a single array, sec->relas, which
+ * is walked with for_each_rela().  Objects can have a very large number of
+ * relas so keep this small.
+ */
 struct rela {
-	struct list_head list;
-	GElf_Rela rela;
 	struct symbol *sym;
-	unsigned int type;
+	char *string;
 	int addend;
 	int offset;
-	char *string;
+	unsigned int type;
 };
 
+#define for_each_rela(rela, sec) \
+	for ((rela) = (sec)->relas; \
+	     (rela) < (sec)->relas + (sec)->nr_relas; (rela)++)
+
 struct string {
 	struct list_head list;
 	char *name;
@@ -108,10 +133,14 @@ struct string {
 
 struct kpatch_elf {
 	Elf *elf;
+	GElf_Ehdr ehdr;
 	struct list_head sections;
 	struct list_head symbols;
 	struct list_head strings;
 	int fd;
+	/* the mapping holding the elements of a model from the cache */
+	void *map;
+	size_t map_size;
 };
 
 #define PATCH_INSN_SIZE 5
@@ -126,20 +155,35 @@ struct livepatch_patch_func {
 	unsigned char pad[31];
 };
 
+/* What to do with the .debug_* sections of the output, see --debug-info */
+enum debug_info {
+	DEBUG_INFO_KEEP,
+	DEBUG_INFO_STRIP,
+	DEBUG_INFO_ZLIB,
+	DEBUG_INFO_ZSTD,
+	DEBUG_INFO_SPLIT,
+};
+
+int kpatch_parse_debug_info(const char *arg);
+int kpatch_debug_info_compression(int debug_info);
+
 struct special_section {
 	char *name;
 	int (*group_size)(struct kpatch_elf *kelf, int offset);
 };
 
 struct kpatch_elf *kpatch_elf_open(const char *name);
+void kpatch_elf_load_section(struct kpatch_elf *kelf, struct section *sec);
 void kpatch_elf_free(struct kpatch_elf *kelf);
 void kpatch_elf_teardown(struct kpatch_elf *kelf);
-void kpatch_write_output_elf(struct kpatch_elf *kelf,
-			      Elf *elf, char *outfile);
+void kpatch_elf_detach(struct kpatch_elf *kelf);
+void kpatch_write_output_elf(struct kpatch_elf *kelf, char *outfile,
+			     int compress);
 void kpatch_dump_kelf(struct kpatch_elf *kelf);
 void kpatch_create_symtab(struct kpatch_elf *kelf);
 void kpatch_create_strtab(struct kpatch_elf *kelf);
 void kpatch_create_shstrtab(struct kpatch_elf *kelf);
+void kpatch_reindex_elements(struct kpatch_elf *kelf);
 void kpatch_rebuild_rela_section_data(struct section *sec);
 
 struct section *find_section_by_index(struct list_head *list, unsigned int index);
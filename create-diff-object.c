@@ -39,7 +39,9 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
@@ -47,25 +49,25 @@
 #include <error.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include <gelf.h>
 
 #include "list.h"
 #include "lookup.h"
 #include "asm/insn.h"
 #include "common.h"
+#include "server.h"
+#include "model.h"
+#include "debuginfo.h"
 
 char *childobj;
 enum loglevel loglevel = NORMAL;
 
-static void kpatch_compare_elf_headers(Elf *elf1, Elf *elf2)
+/* Compare the ELF headers saved by kpatch_elf_open() */
+static void kpatch_compare_elf_headers(struct kpatch_elf *kelf1,
+				       struct kpatch_elf *kelf2)
 {
-	GElf_Ehdr eh1, eh2;
-
-	if (!gelf_getehdr(elf1, &eh1))
-		ERROR("gelf_getehdr");
-
-	if (!gelf_getehdr(elf2, &eh2))
-		ERROR("gelf_getehdr");
+	GElf_Ehdr eh1 = kelf1->ehdr, eh2 = kelf2->ehdr;
 
 	if (memcmp(eh1.e_ident, eh2.e_ident, EI_NIDENT) ||
 	    eh1.e_type != eh2.e_type ||
@@ -135,7 +137,7 @@ static void kpatch_replace_sections_syms(struct kpatch_elf *kelf)
 		    is_debug_section(sec))
 			continue;
 
-		list_for_each_entry(rela, &sec->relas, list) {
+		for_each_rela(rela, sec) {
 
 			if (rela->sym->type != STT_SECTION)
 				continue;
@@ -488,7 +490,7 @@ static struct symbol *kpatch_find_static_twin(struct section *sec,
 		return NULL;
 
 	/* find the patched object's corresponding variable */
-	list_for_each_entry(rela, &sec->twin->relas, list) {
+	for_each_rela(rela, sec->twin) {
 
 		if (rela->sym->twin)
 			continue;
@@ -573,7 +575,7 @@ void kpatch_correlate_static_local_variables(struct kpatch_elf *base,
 			    is_debug_section(sec))
 				continue;
 
-			list_for_each_entry(rela, &sec->relas, list) {
+			for_each_rela(rela, sec) {
 
 				if (rela->sym != sym)
 					continue;
@@ -669,7 +671,7 @@ void kpatch_correlate_static_local_variables(struct kpatch_elf *base,
 			    is_debug_section(sec))
 				continue;
 
-			list_for_each_entry(rela, &sec->relas, list) {
+			for_each_rela(rela, sec) {
 
 				if (rela->sym != sym)
 					continue;
@@ -717,12 +719,12 @@ static int rela_equal(struct rela *rela1, struct rela *rela2)
 
 static void kpatch_compare_correlated_rela_section(struct section *sec)
 {
-	struct rela *rela1, *rela2 = NULL;
+	struct rela *rela1, *rela2;
 
-	rela2 = list_entry(sec->twin->relas.next, struct rela, list);
-	list_for_each_entry(rela1, &sec->relas, list) {
+	rela2 = sec->twin->relas;
+	for_each_rela(rela1, sec) {
 		if (rela_equal(rela1, rela2)) {
-			rela2 = list_entry(rela2->list.next, struct rela, list);
+			rela2++;
 			continue;
 		}
 		sec->status = CHANGED;
@@ -757,8 +759,22 @@ static void kpatch_compare_correlated_section(struct section *sec)
 	    sec1->sh.sh_entsize != sec2->sh.sh_entsize)
 		DIFF_FATAL("%s section header details differ", sec1->name);
 
-	if (sec1->sh.sh_size != sec2->sh.sh_size ||
-	    sec1->data->d_size != sec2->data->d_size) {
+	if (sec1->sh.sh_size != sec2->sh.sh_size) {
+		sec->status = CHANGED;
+		goto out;
+	}
+
+	/*
+	 * The .debug_* sections are always included in full by
+	 * kpatch_include_debug_sections(), so there is no need to read and
+	 * compare their contents.
+	 */
+	if (is_debug_section(sec)) {
+		sec->status = SAME;
+		goto out;
+	}
+
+	if (sec1->data->d_size != sec2->data->d_size) {
 		sec->status = CHANGED;
 		goto out;
 	}
@@ -772,18 +788,114 @@ out:
 		log_debug("section %s has changed\n", sec->name);
 }
 
-static void kpatch_compare_sections(struct list_head *seclist)
+struct compare_job {
+	struct section **secs;
+	int nr;
+	struct log_buffer log;
+};
+
+static void kpatch_compare_section_range(struct section **secs, int nr)
 {
-	struct section *sec;
+	int i;
 
-	/* compare all sections */
-	list_for_each_entry(sec, seclist, list) {
-		if (sec->twin)
-			kpatch_compare_correlated_section(sec);
+	for (i = 0; i < nr; i++) {
+		if (secs[i]->twin)
+			kpatch_compare_correlated_section(secs[i]);
 		else
-			sec->status = NEW;
+			secs[i]->status = NEW;
+	}
+}
+
+static void *kpatch_compare_sections_thread(void *arg)
+{
+	struct compare_job *job = arg;
+
+	log_buffer_start(&job->log);
+	kpatch_compare_section_range(job->secs, job->nr);
+	log_buffer_stop(&job->log);
+
+	return NULL;
+}
+
+/*
+ * Each comparison only touches the status of its own section, so the
+ * sections can be compared in parallel.  The list is split into contiguous
+ * ranges of roughly equal size in bytes, one per thread, and the log output
+ * of the ranges is written out in list order.
+ */
+static void kpatch_compare_sections_parallel(struct list_head *seclist,
+					     int threads)
+{
+	struct section *sec, **secs;
+	struct compare_job *jobs;
+	pthread_t *tids;
+	unsigned long total = 0, done = 0;
+	int nr = 0, i, j, start;
+
+	list_for_each_entry(sec, seclist, list) {
+		total += sec->sh.sh_size;
+		nr++;
+	}
+
+	if (threads > nr)
+		threads = nr;
+
+	secs = malloc(nr * sizeof(*secs));
+	jobs = malloc(threads * sizeof(*jobs));
+	tids = malloc(threads * sizeof(*tids));
+	if (!secs || !jobs || !tids)
+		ERROR("malloc");
+	memset(jobs, 0, threads * sizeof(*jobs));
+
+	i = 0;
+	list_for_each_entry(sec, seclist, list)
+		secs[i++] = sec;
+
+	/* split the sections into ranges of roughly equal total size */
+	start = 0;
+	for (j = 0; j < threads; j++) {
+		jobs[j].secs = secs + start;
+		for (i = start; i < nr; i++) {
+			if (j < threads - 1 && i > start &&
+			    done >= total / threads * (j + 1))
+				break;
+			done += secs[i]->sh.sh_size;
+		}
+		jobs[j].nr = i - start;
+		start = i;
 	}
 
+	for (j = 0; j < threads; j++)
+		if (pthread_create(&tids[j], NULL,
+				   kpatch_compare_sections_thread, &jobs[j]))
+			ERROR("pthread_create");
+
+	for (j = 0; j < threads; j++) {
+		if (pthread_join(tids[j], NULL))
+			ERROR("pthread_join");
+		log_buffer_flush(&jobs[j].log);
+	}
+
+	free(tids);
+	free(jobs);
+	free(secs);
+}
+
+static void kpatch_compare_sections(struct list_head *seclist, int threads)
+{
+	struct section *sec;
+
+	/* compare all sections */
+	if (threads > 1)
+		kpatch_compare_sections_parallel(seclist, threads);
+	else
+		list_for_each_entry(sec, seclist, list) {
+			if (sec->twin)
+				kpatch_compare_correlated_section(sec);
+			else
+				sec->status = NEW;
+		}
+
 	/* sync symbol status */
 	list_for_each_entry(sec, seclist, list) {
 		if (is_rela_section(sec)) {
@@ -846,11 +958,12 @@ static void kpatch_compare_symbols(struct list_head *symlist)
 	}
 }
 
-static void kpatch_compare_correlated_elements(struct kpatch_elf *kelf)
+static void kpatch_compare_correlated_elements(struct kpatch_elf *kelf,
+					       int threads)
 {
 	/* lists are already correlated at this point */
 	log_debug("Compare sections\n");
-	kpatch_compare_sections(&kelf->sections);
+	kpatch_compare_sections(&kelf->sections, threads);
 	log_debug("Compare symbols\n");
 	kpatch_compare_symbols(&kelf->symbols);
 }
@@ -864,7 +977,7 @@ static void kpatch_mark_ignored_functions_same(struct kpatch_elf *kelf)
 	if (!sec)
 		return;
 
-	list_for_each_entry(rela, &sec->rela->relas, list) {
+	for_each_rela(rela, sec->rela) {
 		if (!rela->sym->sec)
 			ERROR("expected bundled symbol");
 		if (rela->sym->type != STT_FUNC)
@@ -891,7 +1004,7 @@ static void kpatch_mark_ignored_sections(struct kpatch_elf *kelf)
 	if (!sec)
 		return;
 
-	list_for_each_entry(rela, &sec->rela->relas, list) {
+	for_each_rela(rela, sec->rela) {
 		strsec = rela->sym->sec;
 		strsec->status = CHANGED;
 		/*
@@ -974,7 +1087,7 @@ static int fixup_group_size(struct kpatch_elf *kelf, int offset)
 
 	/* find beginning of this group */
 	found = 0;
-	list_for_each_entry(rela, &sec->relas, list) {
+	for_each_rela(rela, sec) {
 		if (!strcmp(rela->sym->name, ".fixup") &&
 		    rela->addend == offset) {
 				found = 1;
@@ -987,7 +1100,7 @@ static int fixup_group_size(struct kpatch_elf *kelf, int offset)
 
 	/* find beginning of next group */
 	found = 0;
-	list_for_each_entry_continue(rela, &sec->relas, list) {
+	for (rela++; rela < sec->relas + sec->nr_relas; rela++) {
 		if (!strcmp(rela->sym->name, ".fixup") &&
 		    rela->addend > offset) {
 			found = 1;
@@ -1043,7 +1156,7 @@ static int should_keep_rela_group(struct section *sec, int start, int size)
 	int found = 0;
 
 	/* check if any relas in the group reference any changed functions */
-	list_for_each_entry(rela, &sec->relas, list) {
+	for_each_rela(rela, sec) {
 		if (rela->offset >= start &&
 		    rela->offset < start + size &&
 		    rela->sym->type == STT_FUNC &&
@@ -1061,11 +1174,14 @@ static void kpatch_regenerate_special_section(struct kpatch_elf *kelf,
 				              struct special_section *special,
 				              struct section *sec)
 {
-	struct rela *rela, *safe;
+	struct rela *rela, *newrelas;
 	char *src, *dest;
 	int group_size, src_offset, dest_offset, include, align, aligned_size;
+	unsigned int nr = 0;
 
-	LIST_HEAD(newrelas);
+	newrelas = malloc(sec->nr_relas * sizeof(*newrelas));
+	if (!newrelas && sec->nr_relas)
+		ERROR("malloc");
 
 	src = sec->base->data->d_buf;
 	/* alloc buffer for new base section */
@@ -1089,15 +1205,13 @@ static void kpatch_regenerate_special_section(struct kpatch_elf *kelf,
 		 * aren't sorted (e.g. .rela.fixup), so go through the entire
 		 * rela list each time.
 		 */
-		list_for_each_entry_safe(rela, safe, &sec->relas, list) {
+		for_each_rela(rela, sec) {
 			if (rela->offset >= src_offset &&
 			    rela->offset < src_offset + group_size) {
 				/* copy rela entry */
-				list_del(&rela->list);
-				list_add_tail(&rela->list, &newrelas);
-
-				rela->offset -= src_offset - dest_offset;
-				rela->rela.r_offset = rela->offset;
+				newrelas[nr] = *rela;
+				newrelas[nr].offset -= src_offset - dest_offset;
+				nr++;
 
 				rela->sym->include = 1;
 			}
@@ -1119,11 +1233,14 @@ static void kpatch_regenerate_special_section(struct kpatch_elf *kelf,
 		sec->status = sec->base->status = SAME;
 		sec->include = sec->base->include = 0;
 		free(dest);
+		free(newrelas);
 		return;
 	}
 
-	/* overwrite with new relas list */
-	list_replace(&newrelas, &sec->relas);
+	/* overwrite with new relas array */
+	free(sec->relas);
+	sec->relas = newrelas;
+	sec->nr_relas = nr;
 
 	/* include both rela and base sections */
 	sec->include = 1;
@@ -1139,6 +1256,125 @@ static void kpatch_regenerate_special_section(struct kpatch_elf *kelf,
 	sec->base->data->d_size = dest_offset;
 }
 
+/* struct alt_instr */
+#define ALT_INSTR_SIZE		12
+#define ALT_REPL_OFFSET		4
+#define ALT_REPL_LEN		11
+
+/*
+ * Once .altinstructions has been cut down to the entries of the included
+ * functions, rebuild .altinstr_replacement with just the replacements those
+ * entries point to, and only the relas within them.  The repl_offset relas
+ * of the entries are moved along with their replacements.
+ *
+ * Returns -1 if the sections don't look as expected, in which case nothing
+ * has been changed.
+ */
+static int kpatch_prune_altinstr_replacement(struct kpatch_elf *kelf,
+					      struct section *repl)
+{
+	struct section *altsec;
+	struct symbol *sym;
+	struct rela *rela;
+	unsigned char *alt;
+	char *buf = repl->data->d_buf, *newbuf, *keep;
+	size_t size = repl->data->d_size, i;
+	long *newpos, n = 0;
+	unsigned int nr = 0, len;
+	int ret = -1;
+
+	altsec = find_section_by_name(&kelf->sections, ".altinstructions");
+	if (!altsec || !buf || !size || !repl->secsym)
+		return -1;
+	if (altsec->include &&
+	    (!altsec->rela || altsec->data->d_size % ALT_INSTR_SIZE))
+		return -1;
+	alt = altsec->data->d_buf;
+
+	list_for_each_entry(sym, &kelf->symbols, list)
+		if (sym->sec == repl && sym != repl->secsym)
+			return -1;
+	if (repl->rela)
+		for_each_rela(rela, repl->rela)
+			if (rela->sym->sec == repl || rela->offset < 0 ||
+			    rela->offset >= size)
+				return -1;
+
+	keep = calloc(size, 1);
+	newpos = malloc(size * sizeof(*newpos));
+	if (!keep || !newpos)
+		ERROR("malloc");
+
+	/* keep the replacements of the kept entries */
+	if (altsec->include) {
+		for_each_rela(rela, altsec->rela) {
+			if (rela->offset % ALT_INSTR_SIZE != ALT_REPL_OFFSET)
+				continue;
+			if (rela->sym != repl->secsym ||
+			    rela->type != R_X86_64_PC32)
+				goto out;
+			len = alt[rela->offset - ALT_REPL_OFFSET + ALT_REPL_LEN];
+			if (rela->addend < 0 || rela->addend + len > size)
+				goto out;
+			memset(keep + rela->addend, 1, len);
+		}
+	}
+
+	for (i = 0; i < size; i++)
+		newpos[i] = keep[i] ? n++ : -1;
+	log_debug("Prune %s from %zu to %ld bytes\n", repl->name, size, n);
+
+	newbuf = malloc(n);
+	if (!newbuf && n)
+		ERROR("malloc");
+	for (i = 0; i < size; i++)
+		if (keep[i])
+			newbuf[newpos[i]] = buf[i];
+
+	/* an empty replacement is never read, it can point anywhere */
+	if (altsec->include) {
+		for_each_rela(rela, altsec->rela) {
+			if (rela->offset % ALT_INSTR_SIZE != ALT_REPL_OFFSET)
+				continue;
+			len = alt[rela->offset - ALT_REPL_OFFSET + ALT_REPL_LEN];
+			rela->addend = len ? newpos[rela->addend] : 0;
+		}
+	}
+
+	if (repl->rela) {
+		for_each_rela(rela, repl->rela) {
+			if (newpos[rela->offset] == -1)
+				continue;
+			rela->sym->include = 1;
+			repl->rela->relas[nr] = *rela;
+			repl->rela->relas[nr].offset = newpos[rela->offset];
+			nr++;
+		}
+		repl->rela->nr_relas = nr;
+	}
+
+	repl->data->d_buf = newbuf;
+	repl->data->d_size = n;
+	repl->sh.sh_size = n;
+
+	if (altsec->include) {
+		repl->include = 1;
+		repl->secsym->include = 1;
+		if (repl->rela)
+			repl->rela->include = 1;
+	} else {
+		/* like a special section with no groups left */
+		repl->status = SAME;
+		if (repl->rela)
+			repl->rela->status = SAME;
+	}
+	ret = 0;
+out:
+	free(keep);
+	free(newpos);
+	return ret;
+}
+
 static void kpatch_process_special_sections(struct kpatch_elf *kelf)
 {
 	struct special_section *special;
@@ -1158,32 +1394,43 @@ static void kpatch_process_special_sections(struct kpatch_elf *kelf)
 		kpatch_regenerate_special_section(kelf, special, sec);
 	}
 
+	sec = find_section_by_name(&kelf->sections, ".altinstr_replacement");
+	if (!sec || !kpatch_prune_altinstr_replacement(kelf, sec))
+		return;
+
 	/*
-	 * The following special sections don't have relas which reference
-	 * non-included symbols, so their entire rela section can be included.
+	 * .altinstr_replacement doesn't have relas which reference
+	 * non-included symbols, so its entire rela section can be included.
 	 */
-	list_for_each_entry(sec, &kelf->sections, list) {
-		if (strcmp(sec->name, ".altinstr_replacement"))
-			continue;
+	log_debug("Include all of %s\n", sec->name);
 
-		/* include base section */
-		sec->include = 1;
+	/* include base section */
+	sec->include = 1;
 
-		/* include all symbols in the section */
-		list_for_each_entry(sym, &kelf->symbols, list)
-			if (sym->sec == sec)
-				sym->include = 1;
+	/* include all symbols in the section */
+	list_for_each_entry(sym, &kelf->symbols, list)
+		if (sym->sec == sec)
+			sym->include = 1;
 
-		/* include rela section */
-		if (sec->rela) {
-			sec->rela->include = 1;
-			/* include all symbols referenced by relas */
-			list_for_each_entry(rela, &sec->rela->relas, list)
-				rela->sym->include = 1;
-		}
+	/* include rela section */
+	if (sec->rela) {
+		sec->rela->include = 1;
+		/* include all symbols referenced by relas */
+		for_each_rela(rela, sec->rela)
+			rela->sym->include = 1;
 	}
 }
 
+/*
+ * .rodata.str1.*, or .rodata.<function>.str1.* when a newer gcc builds with
+ * -fdata-sections
+ */
+static int is_string_literal_section(struct section *sec)
+{
+	return !strncmp(sec->name, ".rodata", 7) &&
+	       strstr(sec->name + 7, ".str1.");
+}
+
 static void kpatch_include_standard_elements(struct kpatch_elf *kelf)
 {
 	struct section *sec;
@@ -1193,7 +1440,7 @@ static void kpatch_include_standard_elements(struct kpatch_elf *kelf)
 		if (!strcmp(sec->name, ".shstrtab") ||
 		    !strcmp(sec->name, ".strtab") ||
 		    !strcmp(sec->name, ".symtab") ||
-		    !strncmp(sec->name, ".rodata.str1.", 13)) {
+		    is_string_literal_section(sec)) {
 			sec->include = 1;
 			if (sec->secsym)
 				sec->secsym->include = 1;
@@ -1234,7 +1481,7 @@ static void kpatch_include_symbol(struct symbol *sym, int recurselevel)
 		goto out;
 	sec->rela->include = 1;
 	inc_printf("section %s is included\n", sec->rela->name);
-	list_for_each_entry(rela, &sec->rela->relas, list)
+	for_each_rela(rela, sec->rela)
 		kpatch_include_symbol(rela->sym, recurselevel+1);
 out:
 	inc_printf("end include_symbol(%s)\n", sym->name);
@@ -1265,17 +1512,22 @@ static int kpatch_include_changed_functions(struct kpatch_elf *kelf)
 static void kpatch_include_debug_sections(struct kpatch_elf *kelf)
 {
 	struct section *sec;
-	struct rela *rela, *saferela;
+	struct rela *rela;
+	unsigned int nr;
 
 	/* include all .debug_* sections */
 	list_for_each_entry(sec, &kelf->sections, list) {
 		if (is_debug_section(sec)) {
+			kpatch_elf_load_section(kelf, sec);
 			sec->include = 1;
-			if (!is_rela_section(sec))
+			if (!is_rela_section(sec) && sec->secsym)
 				sec->secsym->include = 1;
 		}
 	}
 
+	/* drop the entries describing code which isn't included */
+	kpatch_prune_debug_sections(kelf);
+
 	/*
 	 * Go through the .rela.debug_ sections and strip entries
 	 * referencing unchanged symbols
@@ -1283,12 +1535,27 @@ static void kpatch_include_debug_sections(struct kpatch_elf *kelf)
 	list_for_each_entry(sec, &kelf->sections, list) {
 		if (!is_rela_section(sec) || !is_debug_section(sec))
 			continue;
-		list_for_each_entry_safe(rela, saferela, &sec->relas, list)
-			if (!rela->sym->sec->include)
-				list_del(&rela->list);
+		nr = 0;
+		for_each_rela(rela, sec)
+			if (rela->sym->sec->include)
+				sec->relas[nr++] = *rela;
+		sec->nr_relas = nr;
 	}
 }
 
+/*
+ * With --debug-info=strip the .debug_* sections are left out of the output,
+ * so whatever changed in them doesn't need to be included.
+ */
+static void kpatch_strip_debug_sections(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+
+	list_for_each_entry(sec, &kelf->sections, list)
+		if (is_debug_section(sec))
+			sec->status = SAME;
+}
+
 static void kpatch_include_hook_elements(struct kpatch_elf *kelf)
 {
 	struct section *sec;
@@ -1304,8 +1571,7 @@ static void kpatch_include_hook_elements(struct kpatch_elf *kelf)
 			sec->include = 1;
 			if (is_rela_section(sec)) {
 				/* include hook dependencies */
-				rela = list_entry(sec->relas.next,
-			                         struct rela, list);
+				rela = &sec->relas[0];
 				sym = rela->sym;
 				log_normal("found hook: %s\n",sym->name);
 				kpatch_include_symbol(sym, 0);
@@ -1401,6 +1667,148 @@ static void kpatch_verify_patchability(struct kpatch_elf *kelf)
 		DIFF_FATAL("%d unsupported section change(s)", errs);
 }
 
+/*
+ * Returns 1 if the string a rela points to at offset off of its section is
+ * where the relocation points, give or take the instruction length which is
+ * already accounted for in rela->string.
+ */
+static int is_prunable_string_rela(struct section *relasec, struct rela *rela,
+				   long off)
+{
+	struct symbol *sym = rela->sym;
+
+	if (!rela->string || off < 0 || off >= sym->sec->data->d_size ||
+	    (sym != sym->sec->secsym && !is_constant_label(sym)))
+		return 0;
+
+	if (rela->type == R_X86_64_PC32 || rela->type == R_X86_64_PLT32)
+		return !strncmp(relasec->base->name, ".text", 5);
+
+	return off == sym->sym.st_value + rela->addend;
+}
+
+/* Mark the string around offset off of buf to be kept */
+static void keep_string(char *buf, size_t size, size_t off, char *keep)
+{
+	size_t start, end;
+
+	for (start = off; start && buf[start - 1]; start--)
+		;
+	for (end = off; end < size - 1 && buf[end]; end++)
+		;
+	memset(keep + start, 1, end - start + 1);
+}
+
+/*
+ * The string literal sections are included in full, though the included
+ * code usually only uses a few of their strings.  Rebuild them with just the
+ * strings that the included relas point to.  The .LC labels of the strings
+ * move with them and the addends of the relas are adjusted for the rest.
+ * A section is left as it is if anything references it other than through
+ * such a rela.
+ */
+static void kpatch_prune_string_section(struct kpatch_elf *kelf,
+					struct section *strsec)
+{
+	struct section *sec;
+	struct symbol *sym;
+	struct rela *rela;
+	char *buf = strsec->data->d_buf, *newbuf, *keep;
+	size_t size = strsec->data->d_size, i;
+	long *newpos, off, n = 0;
+
+	list_for_each_entry(sym, &kelf->symbols, list)
+		if (sym->sec == strsec && sym->include &&
+		    sym != strsec->secsym && !is_constant_label(sym))
+			return;
+
+	keep = calloc(size, 1);
+	newpos = malloc(size * sizeof(*newpos));
+	if (!keep || !newpos)
+		ERROR("malloc");
+
+	/* keep each referenced string, and the one its label is on */
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!is_rela_section(sec) || !sec->include)
+			continue;
+		for_each_rela(rela, sec) {
+			if (rela->sym->sec != strsec)
+				continue;
+			off = rela->string - buf;
+			if (!is_prunable_string_rela(sec, rela, off) ||
+			    rela->sym->sym.st_value >= size)
+				goto out;
+			keep_string(buf, size, off, keep);
+			if (rela->sym != strsec->secsym)
+				keep_string(buf, size, rela->sym->sym.st_value,
+					    keep);
+		}
+	}
+
+	for (i = 0; i < size; i++)
+		newpos[i] = keep[i] ? n++ : -1;
+	if (n == size)
+		goto out;
+
+	log_debug("Prune %s from %zu to %ld bytes\n", strsec->name, size, n);
+	newbuf = malloc(n);
+	if (!newbuf && n)
+		ERROR("malloc");
+	for (i = 0; i < size; i++)
+		if (keep[i])
+			newbuf[newpos[i]] = buf[i];
+
+	/* the section symbol stays at 0, labels move with their string */
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!is_rela_section(sec) || !sec->include)
+			continue;
+		for_each_rela(rela, sec) {
+			if (rela->sym->sec != strsec)
+				continue;
+			off = rela->string - buf;
+			rela->addend += newpos[off] - off;
+			if (rela->sym != strsec->secsym)
+				rela->addend -= newpos[rela->sym->sym.st_value] -
+						rela->sym->sym.st_value;
+			rela->string = newbuf + newpos[off];
+		}
+	}
+
+	/* labels of dropped strings aren't referenced by anything included */
+	list_for_each_entry(sym, &kelf->symbols, list) {
+		if (sym->sec != strsec || sym == strsec->secsym ||
+		    !sym->include)
+			continue;
+		if (newpos[sym->sym.st_value] == -1)
+			sym->include = 0;
+		else
+			sym->sym.st_value = newpos[sym->sym.st_value];
+	}
+
+	strsec->data->d_buf = newbuf;
+	strsec->data->d_size = n;
+	strsec->sh.sh_size = n;
+	if (!n) {
+		strsec->include = 0;
+		if (strsec->secsym)
+			strsec->secsym->include = 0;
+	}
+out:
+	free(keep);
+	free(newpos);
+}
+
+static void kpatch_prune_string_sections(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+
+	list_for_each_entry(sec, &kelf->sections, list)
+		if (sec->include && sec->data && sec->data->d_buf &&
+		    sec->data->d_size && sec->sh.sh_entsize == 1 &&
+		    is_string_literal_section(sec))
+			kpatch_prune_string_section(kelf, sec);
+}
+
 static void kpatch_migrate_included_elements(struct kpatch_elf *kelf,
 					     struct kpatch_elf **kelfout)
 {
@@ -1416,6 +1824,8 @@ static void kpatch_migrate_included_elements(struct kpatch_elf *kelf,
 	INIT_LIST_HEAD(&out->sections);
 	INIT_LIST_HEAD(&out->symbols);
 	INIT_LIST_HEAD(&out->strings);
+	out->ehdr = kelf->ehdr;
+	out->fd = -1;
 
 	/* migrate included sections from kelf to out */
 	list_for_each_entry_safe(sec, safesec, &kelf->sections, list) {
@@ -1582,6 +1992,62 @@ static void livepatch_rename_local_symbols(struct kpatch_elf *kelf, char *hint)
 	}
 }
 
+/*
+ * Keep only the symbols the module needs: those which relocations refer to,
+ * the functions, which show up in backtraces, the defined globals, which a
+ * later patch may link against, and the FILE symbols.  The hypervisor
+ * registers every named symbol of the module when loading it.
+ */
+static void livepatch_minimize_symtab(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	struct symbol *sym, *safe;
+	struct rela *rela;
+	size_t entsize, nr = 0, strsize = 0, new_nr = 0, new_strsize = 0;
+
+	list_for_each_entry(sym, &kelf->symbols, list) {
+		nr++;
+		if (sym->type != STT_SECTION)
+			strsize += strlen(sym->name) + 1;
+
+		/* the NULL symbol has no name */
+		sym->include = !strlen(sym->name) ||
+			       sym->type == STT_FILE ||
+			       (sym->type == STT_FUNC && sym->sec) ||
+			       (sym->bind != STB_LOCAL &&
+				sym->sym.st_shndx != SHN_UNDEF);
+	}
+
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!is_rela_section(sec))
+			continue;
+		for_each_rela(rela, sec)
+			rela->sym->include = 1;
+	}
+
+	list_for_each_entry_safe(sym, safe, &kelf->symbols, list) {
+		if (sym->include) {
+			new_nr++;
+			if (sym->type != STT_SECTION)
+				new_strsize += strlen(sym->name) + 1;
+			continue;
+		}
+
+		log_debug("Strip symbol %s\n", sym->name);
+		if (sym->sec && sym->sec->sym == sym)
+			sym->sec->sym = NULL;
+		if (sym->sec && sym->sec->secsym == sym)
+			sym->sec->secsym = NULL;
+		list_del(&sym->list);
+		free(sym);
+	}
+
+	entsize = find_section_by_name(&kelf->sections, ".symtab")->sh.sh_entsize;
+	log_normal("minimal symtab: %zu -> %zu symbols, symtab %zu -> %zu bytes, "
+		   "strtab %zu -> %zu bytes\n", nr, new_nr, nr * entsize,
+		   new_nr * entsize, strsize, new_strsize);
+}
+
 static struct section *create_section_pair(struct kpatch_elf *kelf,
 					   char *name, int entsize, int nr)
 {
@@ -1620,7 +2086,6 @@ static struct section *create_section_pair(struct kpatch_elf *kelf,
 	ALLOC_LINK(relasec, &kelf->sections);
 	relasec->name = relaname;
 	relasec->base = sec;
-	INIT_LIST_HEAD(&relasec->relas);
 
 	/* set data, buffers generated by kpatch_rebuild_rela_section_data() */
 	relasec->data = malloc(sizeof(*relasec->data));
@@ -1661,6 +2126,14 @@ static void livepatch_create_patches_sections(struct kpatch_elf *kelf,
 	relasec = sec->rela;
 	funcs = sec->data->d_buf;
 
+	/* two relas per patched function */
+	relasec->relas = malloc(2 * nr * sizeof(*relasec->relas));
+	if (!relasec->relas && nr)
+		ERROR("malloc");
+	memset(relasec->relas, 0, 2 * nr * sizeof(*relasec->relas));
+	relasec->nr_relas = 2 * nr;
+	rela = relasec->relas;
+
 	/* lookup strings symbol */
 	strsym = find_symbol_by_name(&kelf->symbols, ".livepatch.strings");
 	if (!strsym)
@@ -1707,24 +2180,24 @@ static void livepatch_create_patches_sections(struct kpatch_elf *kelf,
 			 * the funcs[index].new_addr field at
 			 * module load time.
 			 */
-			ALLOC_LINK(rela, &relasec->relas);
 			rela->sym = sym;
 			rela->type = R_X86_64_64;
 			rela->addend = 0;
 			rela->offset = index * sizeof(*funcs);
 			rela->offset = index * sizeof(*funcs) +
 			               offsetof(struct livepatch_patch_func, new_addr);
+			rela++;
 
 			/*
 			 * Add a relocation that will populate
 			 * the funcs[index].name field.
 			 */
-			ALLOC_LINK(rela, &relasec->relas);
 			rela->sym = strsym;
 			rela->type = R_X86_64_64;
 			rela->addend = offset_of_string(&kelf->strings, funcname);
 			rela->offset = index * sizeof(*funcs) +
 			               offsetof(struct livepatch_patch_func, name);
+			rela++;
 
 			index++;
 		}
@@ -1769,23 +2242,84 @@ static void kpatch_reorder_symbols(struct kpatch_elf *kelf)
 	list_replace(&symbols, &kelf->symbols);
 }
 
-static void kpatch_reindex_elements(struct kpatch_elf *kelf)
+struct load_job {
+	char *name;
+	char *path;
+	int mark_grouped;
+	/* directory of the model cache, if it is used for this object */
+	char *model_cache;
+	struct kpatch_elf *kelf;
+	struct log_buffer log;
+};
+
+/* Open an object and do the processing which doesn't need its twin. */
+static void kpatch_load_object(struct load_job *job)
 {
-	struct section *sec;
-	struct symbol *sym;
-	int index;
+	char key[MODEL_KEY_SIZE];
+	int cached = job->model_cache && !kpatch_model_key(job->path, key);
+
+	if (cached) {
+		job->kelf = kpatch_model_load(job->model_cache, key);
+		if (job->kelf) {
+			log_debug("Using cached model of %s\n", job->name);
+			return;
+		}
+	}
 
-	index = 1; /* elf write function handles NULL section 0 */
-	list_for_each_entry(sec, &kelf->sections, list)
-		sec->index = index++;
+	log_debug("Open %s\n", job->name);
+	job->kelf = kpatch_elf_open(job->path);
 
-	index = 0;
-	list_for_each_entry(sym, &kelf->symbols, list) {
-		sym->index = index++;
-		if (sym->sec)
-			sym->sym.st_shndx = sym->sec->index;
-		else if (sym->sym.st_shndx != SHN_ABS)
-			sym->sym.st_shndx = SHN_UNDEF;
+	log_debug("Check program headers of %s\n", job->name);
+	kpatch_check_program_headers(job->kelf->elf);
+
+	if (job->mark_grouped) {
+		log_debug("Mark grouped sections\n");
+		kpatch_mark_grouped_sections(job->kelf);
+	}
+
+	log_debug("Replace sections syms %s\n", job->name);
+	kpatch_replace_sections_syms(job->kelf);
+
+	if (cached)
+		kpatch_model_save(job->model_cache, key, job->kelf);
+}
+
+static void *kpatch_load_object_thread(void *arg)
+{
+	struct load_job *job = arg;
+
+	log_buffer_start(&job->log);
+	kpatch_load_object(job);
+	log_buffer_stop(&job->log);
+
+	return NULL;
+}
+
+/*
+ * The base and patched objects are independent of each other until they are
+ * correlated, so with more than one thread they are loaded concurrently.  The
+ * log output of each job is written out in job order afterwards.
+ */
+static void kpatch_load_objects(struct load_job *jobs, int nr, int threads)
+{
+	pthread_t tids[nr];
+	int i;
+
+	if (threads < 2) {
+		for (i = 0; i < nr; i++)
+			kpatch_load_object(&jobs[i]);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		if (pthread_create(&tids[i], NULL, kpatch_load_object_thread,
+				   &jobs[i]))
+			ERROR("pthread_create");
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_join(tids[i], NULL))
+			ERROR("pthread_join");
+		log_buffer_flush(&jobs[i].log);
 	}
 }
 
@@ -1793,6 +2327,11 @@ struct arguments {
 	char *args[4];
 	int debug;
 	int resolve;
+	int threads;
+	char *server;
+	char *model_cache;
+	int debug_info;
+	int minimal_symtab;
 };
 
 static char args_doc[] = "original.o patched.o kernel-object output.o";
@@ -1800,6 +2339,16 @@ static char args_doc[] = "original.o patched.o kernel-object output.o";
 static struct argp_option options[] = {
 	{"debug", 'd', 0, 0, "Show debug output" },
 	{"resolve", 'r', 0, 0, "Resolve to-be-patched function addresses" },
+	{"jobs", 'j', "N", 0, "Use up to N threads" },
+	{"server", 's', "SOCKET", 0,
+	 "Serve requests from clients run with LIVEPATCH_DIFF_SOCKET=SOCKET" },
+	{"model-cache", 'm', "DIR", 0,
+	 "Cache the parsed original object in DIR and reuse it" },
+	{"debug-info", 'g', "POLICY", 0,
+	 "Keep, strip or compress (compress=zlib or compress=zstd) the "
+	 "debug sections" },
+	{"minimal-symtab", 'y', 0, 0,
+	 "Only keep the symbols needed to load the module and for backtraces" },
 	{ 0 }
 };
 
@@ -1817,6 +2366,28 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		case 'r':
 			arguments->resolve = 1;
 			break;
+		case 'j':
+			arguments->threads = atoi(arg);
+			if (arguments->threads < 1)
+				argp_error(state, "invalid number of jobs: %s", arg);
+			break;
+		case 's':
+			arguments->server = arg;
+			break;
+		case 'm':
+			arguments->model_cache = arg;
+			break;
+		case 'y':
+			arguments->minimal_symtab = 1;
+			break;
+		case 'g':
+			arguments->debug_info = kpatch_parse_debug_info(arg);
+			/* splitting needs the build-id set by livepatch-link */
+			if (arguments->debug_info < 0 ||
+			    arguments->debug_info == DEBUG_INFO_SPLIT)
+				argp_error(state, "invalid debug info policy %s",
+					   arg);
+			break;
 		case ARGP_KEY_ARG:
 			if (state->arg_num >= 4)
 				/* Too many arguments. */
@@ -1824,7 +2395,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 			arguments->args[state->arg_num] = arg;
 			break;
 		case ARGP_KEY_END:
-			if (state->arg_num < 4)
+			if (!arguments->server && state->arg_num < 4)
 				/* Not enough arguments. */
 				argp_usage (state);
 			break;
@@ -1836,46 +2407,282 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 
 static struct argp argp = { options, parse_opt, args_doc, 0 };
 
-int main(int argc, char *argv[])
+static int parse_arguments(int argc, char *argv[],
+			   struct arguments *arguments, unsigned flags)
+{
+	memset(arguments, 0, sizeof(*arguments));
+	arguments->threads = 1;
+	return argp_parse (&argp, argc, argv, flags, 0, arguments);
+}
+
+/*
+ * In server mode, the xen-syms lookup table and the loaded base objects of
+ * the requests which succeeded are kept, and reused by later requests for as
+ * long as the files are unchanged.  Each request runs in a child forked from
+ * the server, so whatever it does to them stays its own.
+ *
+ * The files may have been rewritten since the request used them, so loading
+ * them must not take the server down: the objects are loaded in a child and
+ * handed back as a model, and xen-syms with lookup_try_open().
+ */
+#define MAX_CACHED_OBJECTS 256
+
+struct cached_object {
+	struct list_head list;
+	char *path;
+	struct stat st;
+	struct kpatch_elf *kelf;
+};
+
+static LIST_HEAD(cached_objects);
+static int nr_cached_objects;
+static char *cached_lookup_path;
+static struct stat cached_lookup_st;
+static struct lookup_table *cached_lookup;
+
+static int same_file(struct stat *a, struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Return the canonical path of path, relative to dir if given, and stat it */
+static char *resolve_file(const char *dir, const char *path, struct stat *st)
+{
+	char buf[PATH_MAX], *real;
+
+	if (dir && path[0] != '/') {
+		if (snprintf(buf, sizeof(buf), "%s/%s", dir, path) >= sizeof(buf))
+			return NULL;
+		path = buf;
+	}
+
+	real = realpath(path, NULL);
+	if (real && stat(real, st)) {
+		free(real);
+		real = NULL;
+	}
+
+	return real;
+}
+
+static struct kpatch_elf *find_cached_object(const char *path)
+{
+	struct cached_object *obj;
+	struct stat st;
+	char *real;
+
+	if (!nr_cached_objects)
+		return NULL;
+	real = resolve_file(NULL, path, &st);
+	if (!real)
+		return NULL;
+
+	list_for_each_entry(obj, &cached_objects, list) {
+		if (!strcmp(obj->path, real) && same_file(&obj->st, &st)) {
+			free(real);
+			return obj->kelf;
+		}
+	}
+
+	free(real);
+	return NULL;
+}
+
+static void drop_cached_object(struct cached_object *obj)
+{
+	list_del(&obj->list);
+	kpatch_elf_teardown(obj->kelf);
+	kpatch_elf_free(obj->kelf);
+	free(obj->path);
+	free(obj);
+	nr_cached_objects--;
+}
+
+/*
+ * Load an object in a child process, which passes it back through the model
+ * cache in a temporary directory.  Returns NULL if it can't be loaded.
+ */
+static struct kpatch_elf *load_object_isolated(char *path)
+{
+	char tmpdir[] = "/tmp/livepatch-diff-XXXXXX", *model;
+	struct kpatch_elf *kelf = NULL;
+	struct load_job job;
+	int wstatus;
+	pid_t pid;
+
+	if (!mkdtemp(tmpdir))
+		return NULL;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		ERROR("fork");
+	if (!pid) {
+		memset(&job, 0, sizeof(job));
+		job.name = "base";
+		job.path = path;
+		childobj = strrchr(path, '/') + 1;
+		kpatch_load_object(&job);
+		kpatch_model_save(tmpdir, "base", job.kelf);
+		exit(0);
+	}
+
+	while (waitpid(pid, &wstatus, 0) == -1)
+		if (errno != EINTR)
+			ERROR("waitpid");
+	if (WIFEXITED(wstatus) && !WEXITSTATUS(wstatus))
+		kelf = kpatch_model_load(tmpdir, "base");
+
+	if (asprintf(&model, "%s/base.model", tmpdir) == -1)
+		ERROR("asprintf");
+	unlink(model);
+	free(model);
+	rmdir(tmpdir);
+
+	return kelf;
+}
+
+static void cache_object(const char *dir, const char *path)
+{
+	struct cached_object *obj, *safe;
+	struct kpatch_elf *kelf;
+	struct stat st, now;
+	char *real;
+
+	real = resolve_file(dir, path, &st);
+	if (!real)
+		return;
+
+	list_for_each_entry_safe(obj, safe, &cached_objects, list) {
+		if (strcmp(obj->path, real))
+			continue;
+		if (same_file(&obj->st, &st)) {
+			free(real);
+			return;
+		}
+		drop_cached_object(obj);
+	}
+
+	/* drop the oldest */
+	if (nr_cached_objects >= MAX_CACHED_OBJECTS)
+		drop_cached_object(list_first_entry(&cached_objects,
+						    struct cached_object, list));
+
+	kelf = load_object_isolated(real);
+	/* don't keep what may be a mix of two versions of the object */
+	if (kelf && (stat(real, &now) || !same_file(&st, &now))) {
+		kpatch_elf_free(kelf);
+		kelf = NULL;
+	}
+	if (!kelf) {
+		fprintf(stderr, "not caching %s, it failed to load\n", real);
+		free(real);
+		return;
+	}
+
+	ALLOC_LINK(obj, &cached_objects);
+	obj->path = real;
+	obj->st = st;
+	obj->kelf = kelf;
+	nr_cached_objects++;
+}
+
+static struct lookup_table *find_cached_lookup(const char *path)
+{
+	struct stat st;
+	char *real;
+	int match;
+
+	if (!cached_lookup)
+		return NULL;
+	real = resolve_file(NULL, path, &st);
+	if (!real)
+		return NULL;
+
+	match = !strcmp(real, cached_lookup_path) &&
+		same_file(&cached_lookup_st, &st);
+	free(real);
+
+	return match ? cached_lookup : NULL;
+}
+
+static void cache_lookup(const char *dir, const char *path)
+{
+	struct stat st;
+	const char *why;
+	char *real;
+
+	real = resolve_file(dir, path, &st);
+	if (!real)
+		return;
+	if (cached_lookup && !strcmp(real, cached_lookup_path) &&
+	    same_file(&cached_lookup_st, &st)) {
+		free(real);
+		return;
+	}
+
+	if (cached_lookup) {
+		lookup_close(cached_lookup);
+		free(cached_lookup_path);
+		cached_lookup = NULL;
+		cached_lookup_path = NULL;
+	}
+
+	cached_lookup = lookup_try_open(real, &why);
+	if (!cached_lookup) {
+		fprintf(stderr, "not caching %s: %s\n", real, why);
+		free(real);
+		return;
+	}
+	cached_lookup_path = real;
+	cached_lookup_st = st;
+}
+
+/*
+ * Diff an object.  Returns 0 if the output was written and 3 if there are no
+ * changes to write out, errors exit.
+ */
+static int run_diff(struct arguments *arguments)
 {
 	struct kpatch_elf *kelf_base, *kelf_patched, *kelf_out;
-	struct arguments arguments;
+	struct load_job jobs[2];
 	int num_changed, new_globals_exist;
 	struct lookup_table *lookup;
 	struct section *sec, *symtab;
 	struct symbol *sym;
 	char *hint = NULL;
+	int lookup_cached = 0;
 
-	srand(time(NULL));
+	/* requests forked from a server must not share a sequence */
+	srand(time(NULL) ^ getpid());
 
-	arguments.debug = 0;
-	arguments.resolve = 0;
-	argp_parse (&argp, argc, argv, 0, 0, &arguments);
-	if (arguments.debug)
+	if (arguments->debug)
 		loglevel = DEBUG;
 
-	elf_version(EV_CURRENT);
-
-	childobj = basename(arguments.args[0]);
-
-	log_debug("Open base\n");
-	kelf_base = kpatch_elf_open(arguments.args[0]);
-	log_debug("Open patched\n");
-	kelf_patched = kpatch_elf_open(arguments.args[1]);
+	childobj = basename(arguments->args[0]);
+
+	memset(jobs, 0, sizeof(jobs));
+	jobs[0].name = "base";
+	jobs[0].path = arguments->args[0];
+	jobs[0].model_cache = arguments->model_cache;
+	jobs[1].name = "patched";
+	jobs[1].path = arguments->args[1];
+	jobs[1].mark_grouped = 1;
+	jobs[0].kelf = find_cached_object(jobs[0].path);
+	if (jobs[0].kelf) {
+		log_debug("Using cached %s\n", jobs[0].name);
+		kpatch_load_objects(&jobs[1], 1, 1);
+	} else {
+		kpatch_load_objects(jobs, 2, arguments->threads);
+	}
+	kelf_base = jobs[0].kelf;
+	kelf_patched = jobs[1].kelf;
 
 	log_debug("Compare elf headers\n");
-	kpatch_compare_elf_headers(kelf_base->elf, kelf_patched->elf);
-	log_debug("Check program headers of base\n");
-	kpatch_check_program_headers(kelf_base->elf);
-	log_debug("Check program headers of patched\n");
-	kpatch_check_program_headers(kelf_patched->elf);
-
-	log_debug("Mark grouped sections\n");
-	kpatch_mark_grouped_sections(kelf_patched);
-	log_debug("Replace sections syms base\n");
-	kpatch_replace_sections_syms(kelf_base);
-	log_debug("Replace sections syms patched\n");
-	kpatch_replace_sections_syms(kelf_patched);
+	kpatch_compare_elf_headers(kelf_base, kelf_patched);
 	log_debug("Rename mangled functions\n");
 	kpatch_rename_mangled_functions(kelf_base, kelf_patched);
 
@@ -1892,7 +2699,7 @@ int main(int argc, char *argv[])
 	log_debug("Mark ignored sections\n");
 	kpatch_mark_ignored_sections(kelf_patched);
 	log_debug("Compare correlated elements\n");
-	kpatch_compare_correlated_elements(kelf_patched);
+	kpatch_compare_correlated_elements(kelf_patched, arguments->threads);
 	log_debug("Elf teardown base\n");
 	kpatch_elf_teardown(kelf_base);
 	log_debug("Elf free base\n");
@@ -1910,13 +2717,19 @@ int main(int argc, char *argv[])
 	log_debug("Include changed functions\n");
 	num_changed = kpatch_include_changed_functions(kelf_patched);
 	log_debug("num_changed = %d\n", num_changed);
-	log_debug("Include debug sections\n");
-	kpatch_include_debug_sections(kelf_patched);
 	log_debug("Include hook elements\n");
 	kpatch_include_hook_elements(kelf_patched);
 	log_debug("Include new globals\n");
 	new_globals_exist = kpatch_include_new_globals(kelf_patched);
 	log_debug("new_globals_exist = %d\n", new_globals_exist);
+	if (arguments->debug_info == DEBUG_INFO_STRIP) {
+		log_debug("Strip debug sections\n");
+		kpatch_strip_debug_sections(kelf_patched);
+	} else {
+		/* once everything the debug sections can describe is included */
+		log_debug("Include debug sections\n");
+		kpatch_include_debug_sections(kelf_patched);
+	}
 
 	log_debug("Print changes\n");
 	kpatch_print_changes(kelf_patched);
@@ -1932,19 +2745,24 @@ int main(int argc, char *argv[])
 	kpatch_process_special_sections(kelf_patched);
 	log_debug("Verify patchability\n");
 	kpatch_verify_patchability(kelf_patched);
+	log_debug("Prune string sections\n");
+	kpatch_prune_string_sections(kelf_patched);
 
 	/* this is destructive to kelf_patched */
 	log_debug("Migrate included elements\n");
 	kpatch_migrate_included_elements(kelf_patched, &kelf_out);
 
 	/*
-	 * Teardown kelf_patched since we shouldn't access sections or symbols
-	 * through it anymore.  Don't free however, since our section and symbol
-	 * name fields still point to strings in the Elf object owned by
-	 * kpatch_patched.
+	 * Copy the names and data of the output elements out of the Elf
+	 * object owned by kelf_patched, so that it can be freed now rather
+	 * than staying mapped until the output has been written.
 	 */
+	log_debug("Detach out elf\n");
+	kpatch_elf_detach(kelf_out);
 	log_debug("Elf teardown patched\n");
 	kpatch_elf_teardown(kelf_patched);
+	log_debug("Elf free patched\n");
+	kpatch_elf_free(kelf_patched);
 
 	log_debug("Search for source file name\n");
 	list_for_each_entry(sym, &kelf_out->symbols, list) {
@@ -1959,19 +2777,32 @@ int main(int argc, char *argv[])
 
 	/* create symbol lookup table */
 	log_debug("Lookup xen-syms\n");
-	lookup = lookup_open(arguments.args[2]);
+	lookup = find_cached_lookup(arguments->args[2]);
+	if (lookup) {
+		log_debug("Using cached xen-syms\n");
+		lookup_cached = 1;
+	} else {
+		lookup = lookup_open(arguments->args[2]);
+	}
 
 	/* create strings, patches, and dynrelas sections */
 	log_debug("Create strings elements\n");
 	kpatch_create_strings_elements(kelf_out);
 	log_debug("Create patches sections\n");
 	livepatch_create_patches_sections(kelf_out, lookup, hint,
-			                arguments.resolve);
+			                arguments->resolve);
 	kpatch_build_strings_section_data(kelf_out);
+	if (!lookup_cached)
+		lookup_close(lookup);
 
 	log_debug("Rename local symbols\n");
 	livepatch_rename_local_symbols(kelf_out, hint);
 
+	if (arguments->minimal_symtab) {
+		log_debug("Minimize symtab\n");
+		livepatch_minimize_symtab(kelf_out);
+	}
+
 	/*
 	 *  At this point, the set of output sections and symbols is
 	 *  finalized.  Reorder the symbols into linker-compliant
@@ -2007,10 +2838,9 @@ int main(int argc, char *argv[])
 	log_debug("Dump out elf status\n");
 	kpatch_dump_kelf(kelf_out);
 	log_debug("Write out elf\n");
-	kpatch_write_output_elf(kelf_out, kelf_patched->elf, arguments.args[3]);
+	kpatch_write_output_elf(kelf_out, arguments->args[3],
+			kpatch_debug_info_compression(arguments->debug_info));
 
-	log_debug("Elf free patched\n");
-	kpatch_elf_free(kelf_patched);
 	log_debug("Elf teardown out\n");
 	kpatch_elf_teardown(kelf_out);
 	log_debug("Elf free out\n");
@@ -2018,3 +2848,61 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
+
+static int diff_server_run(int argc, char *argv[])
+{
+	struct arguments arguments;
+
+	parse_arguments(argc, argv, &arguments, 0);
+	if (arguments.server)
+		error(1, 0, "--server cannot be requested from a server");
+
+	return run_diff(&arguments);
+}
+
+/* Keep what a request which succeeded has shown can be loaded */
+static void diff_server_done(const char *cwd, int argc, char *argv[],
+			     int status)
+{
+	struct arguments arguments;
+
+	if (status != 0 && status != 3)
+		return;
+	if (parse_arguments(argc, argv, &arguments, ARGP_SILENT) ||
+	    !arguments.args[0] || !arguments.args[2])
+		return;
+
+	cache_object(cwd, arguments.args[0]);
+	cache_lookup(cwd, arguments.args[2]);
+}
+
+static struct server_ops diff_server_ops = {
+	.run = diff_server_run,
+	.done = diff_server_done,
+};
+
+int main(int argc, char *argv[])
+{
+	struct arguments arguments;
+	char *path;
+	int status;
+
+	parse_arguments(argc, argv, &arguments, 0);
+
+	elf_version(EV_CURRENT);
+
+	if (arguments.server) {
+		server_run(arguments.server, &diff_server_ops);
+		return 0;
+	}
+
+	/* Hand the request to a server if there is one */
+	path = getenv("LIVEPATCH_DIFF_SOCKET");
+	if (path && *path) {
+		status = server_request(path, argc, argv);
+		if (status >= 0)
+			return status;
+	}
+
+	return run_diff(&arguments);
+}
@@ -0,0 +1,469 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pruning of the DWARF sections of the patched object, see debuginfo.h.
+ *
+ * The sections handled here are lists of self-contained entries, each of
+ * which is tied to the code it describes by a relocation: an FDE by its
+ * initial location, an address range by its start and a line number
+ * sequence by its DW_LNE_set_address.  The entries of code which isn't
+ * included are dropped, and the length fields of the units which contained
+ * them are recomputed.  Everything else is kept byte for byte.
+ *
+ * Each section is first parsed to mark the bytes to keep.  If it contains
+ * anything unexpected (64-bit DWARF, unknown versions, entries running past
+ * their unit, references to bytes which would be dropped), it is left as it
+ * is.
+ *
+ * Only 32-bit DWARF for 64-bit little-endian targets is handled, which is
+ * what the hypervisor is built as.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <gelf.h>
+
+#include "list.h"
+#include "asm/insn.h"
+#include "common.h"
+#include "debuginfo.h"
+
+#define DW_LNS_fixed_advance_pc	9
+#define DW_LNE_end_sequence	1
+
+struct unit {
+	/* offset of the unit's 32-bit length, and of its end */
+	size_t start, end;
+};
+
+struct debug_prune {
+	struct section *sec;
+	unsigned char *buf;
+	size_t size;
+	/* the bytes of sec to keep */
+	char *keep;
+	/* the rela at each offset of sec, if any */
+	struct rela **relas;
+	/* the units whose length is to be recomputed */
+	struct unit *units;
+	int nr_units;
+};
+
+static uint16_t read_u16(unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t read_u32(unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t read_u64(unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Skip a ULEB128 or SLEB128, returns -1 if it runs past end */
+static int skip_leb128(unsigned char *buf, size_t *off, size_t end)
+{
+	while (*off < end)
+		if (!(buf[(*off)++] & 0x80))
+			return 0;
+	return -1;
+}
+
+static int read_uleb128(unsigned char *buf, size_t *off, size_t end,
+			uint64_t *val)
+{
+	int shift = 0;
+
+	*val = 0;
+	while (*off < end) {
+		*val |= (uint64_t)(buf[*off] & 0x7f) << shift;
+		if (!(buf[(*off)++] & 0x80))
+			return 0;
+		shift += 7;
+		if (shift >= 64)
+			return -1;
+	}
+	return -1;
+}
+
+static void keep_range(struct debug_prune *p, size_t start, size_t end)
+{
+	memset(p->keep + start, 1, end - start);
+}
+
+/* Returns 1 if the rela doesn't point to code which has been left out */
+static int rela_kept(struct rela *rela)
+{
+	return !rela || !rela->sym->sec || rela->sym->sec->include;
+}
+
+/*
+ * Start a unit: check its length and add it to the units to fix up.
+ * Returns its end, or 0 if it is malformed.
+ */
+static size_t add_unit(struct debug_prune *p, size_t off)
+{
+	uint32_t len;
+	size_t end;
+
+	if (off + 4 > p->size)
+		return 0;
+	len = read_u32(p->buf + off);
+	/* 64-bit DWARF, or one of the reserved lengths */
+	if (len >= 0xfffffff0)
+		return 0;
+	end = off + 4 + len;
+	if (end > p->size)
+		return 0;
+
+	p->units = realloc(p->units, (p->nr_units + 1) * sizeof(*p->units));
+	if (!p->units)
+		ERROR("realloc");
+	p->units[p->nr_units].start = off;
+	p->units[p->nr_units].end = end;
+	p->nr_units++;
+
+	return end;
+}
+
+/*
+ * .debug_frame is a list of CIEs and FDEs.  Keep the CIEs and the FDEs of
+ * the included functions.  The FDEs point to their CIE through a rela
+ * against .debug_frame, which is moved along with the CIE.
+ */
+static int mark_debug_frame(struct debug_prune *p)
+{
+	size_t off = 0, end;
+	uint32_t len;
+
+	while (off < p->size) {
+		if (off + 4 > p->size)
+			return -1;
+		len = read_u32(p->buf + off);
+		if (len >= 0xfffffff0)
+			return -1;
+		end = off + 4 + len;
+		if (end > p->size)
+			return -1;
+
+		if (len < 4 || read_u32(p->buf + off + 4) == 0xffffffff) {
+			/* a CIE, or a zero terminator */
+			keep_range(p, off, end);
+		} else {
+			/* CIE pointer, initial location and address range */
+			if (len < 4 + 8 + 8)
+				return -1;
+			if (!p->relas[off + 4] && read_u32(p->buf + off + 4))
+				return -1;
+			if (rela_kept(p->relas[off + 8]))
+				keep_range(p, off, end);
+		}
+
+		off = end;
+	}
+
+	return 0;
+}
+
+/*
+ * .debug_aranges is a list of sets of address ranges, each set describing
+ * one compilation unit.  Keep the ranges of the included functions.
+ */
+static int mark_debug_aranges(struct debug_prune *p)
+{
+	size_t off = 0, end, t;
+
+	while (off < p->size) {
+		end = add_unit(p, off);
+		if (!end || end - off < 16)
+			return -1;
+		/* 64-bit addresses and no segment selectors */
+		if (p->buf[off + 10] != 8 || p->buf[off + 11] != 0)
+			return -1;
+
+		/* the tuples are aligned to twice the address size */
+		keep_range(p, off, off + 16);
+		for (t = off + 16; t + 16 <= end; t += 16) {
+			if (!p->relas[t] && !read_u64(p->buf + t) &&
+			    !read_u64(p->buf + t + 8))
+				break;
+			if (rela_kept(p->relas[t]))
+				keep_range(p, t, t + 16);
+		}
+		/* the terminating tuple and any padding */
+		keep_range(p, t, end);
+
+		off = end;
+	}
+
+	return 0;
+}
+
+/* Keep a line number sequence unless all its addresses are left out */
+static void mark_sequence(struct debug_prune *p, size_t start, size_t end)
+{
+	size_t off;
+	int relocated = 0, kept = 0;
+
+	for (off = start; off < end; off++) {
+		if (!p->relas[off] || !p->relas[off]->sym->sec)
+			continue;
+		relocated = 1;
+		if (p->relas[off]->sym->sec->include)
+			kept = 1;
+	}
+
+	if (!relocated || kept)
+		keep_range(p, start, end);
+}
+
+/*
+ * .debug_line is a list of line number programs, one for each compilation
+ * unit, each made of a header and of sequences of opcodes ending with
+ * DW_LNE_end_sequence.  With -ffunction-sections every function has its own
+ * sequence.  Keep the headers and the sequences of the included functions.
+ */
+static int mark_debug_line(struct debug_prune *p)
+{
+	size_t off = 0, end, hdr, prog, seq;
+	unsigned char *buf = p->buf, *lengths, op, opcode_base;
+	uint16_t version;
+	uint64_t len;
+	int i;
+
+	while (off < p->size) {
+		end = add_unit(p, off);
+		if (!end || end - off < 6)
+			return -1;
+		version = read_u16(buf + off + 4);
+		if (version < 2 || version > 5)
+			return -1;
+
+		/* address_size and segment_selector_size come first in v5 */
+		hdr = off + 6 + (version >= 5 ? 2 : 0);
+		if (hdr + 4 > end)
+			return -1;
+		prog = hdr + 4 + read_u32(buf + hdr);
+		if (prog > end)
+			return -1;
+
+		/*
+		 * minimum_instruction_length, maximum_operations_per_instruction
+		 * from v4, default_is_stmt, line_base and line_range
+		 */
+		hdr += 4 + 1 + (version >= 4 ? 1 : 0) + 3;
+		if (hdr >= prog)
+			return -1;
+		opcode_base = buf[hdr];
+		lengths = buf + hdr + 1;
+		if (!opcode_base || hdr + opcode_base > prog)
+			return -1;
+		keep_range(p, off, prog);
+
+		for (seq = prog; prog < end; ) {
+			op = buf[prog++];
+			if (op >= opcode_base)
+				continue;
+			if (op == 0) {
+				/* extended opcode */
+				if (read_uleb128(buf, &prog, end, &len) ||
+				    len > end - prog)
+					return -1;
+				op = len ? buf[prog] : 0;
+				prog += len;
+				if (len && op == DW_LNE_end_sequence) {
+					mark_sequence(p, seq, prog);
+					seq = prog;
+				}
+				continue;
+			}
+			if (op == DW_LNS_fixed_advance_pc) {
+				prog += 2;
+				if (prog > end)
+					return -1;
+				continue;
+			}
+			for (i = 0; i < lengths[op - 1]; i++)
+				if (skip_leb128(buf, &prog, end))
+					return -1;
+		}
+		/* anything after the last sequence */
+		keep_range(p, seq, end);
+
+		off = end;
+	}
+
+	return 0;
+}
+
+/*
+ * Rebuild the section with the marked bytes.  Returns -1 if that can't be
+ * done because something references bytes which would be dropped.
+ */
+static int prune_section(struct kpatch_elf *kelf, struct debug_prune *p)
+{
+	struct section *sec, *relasec = p->sec->rela;
+	struct rela *rela;
+	unsigned char *newbuf;
+	size_t *before, i, n;
+	unsigned int nr = 0;
+	int u;
+
+	before = malloc((p->size + 1) * sizeof(*before));
+	if (!before)
+		ERROR("malloc");
+	for (i = 0, n = 0; i < p->size; i++) {
+		before[i] = n;
+		if (p->keep[i])
+			n++;
+	}
+	before[p->size] = n;
+
+	if (n == p->size) {
+		free(before);
+		return 0;
+	}
+
+	/* references into the section must be to bytes which are kept */
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!is_rela_section(sec) || !sec->include)
+			continue;
+		for_each_rela(rela, sec) {
+			if (rela->sym->sec != p->sec)
+				continue;
+			if (sec == relasec && !p->keep[rela->offset])
+				continue;
+			if (rela->sym != p->sec->secsym || rela->addend < 0 ||
+			    rela->addend > p->size ||
+			    (rela->addend < p->size && !p->keep[rela->addend])) {
+				free(before);
+				return -1;
+			}
+		}
+	}
+
+	log_debug("Prune %s from %zu to %zu bytes\n", p->sec->name, p->size, n);
+
+	newbuf = malloc(n);
+	if (!newbuf && n)
+		ERROR("malloc");
+	for (i = 0; i < p->size; i++)
+		if (p->keep[i])
+			newbuf[before[i]] = p->buf[i];
+
+	for (u = 0; u < p->nr_units; u++) {
+		uint32_t len = before[p->units[u].end] -
+			       before[p->units[u].start] - 4;
+
+		memcpy(newbuf + before[p->units[u].start], &len, sizeof(len));
+	}
+
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!is_rela_section(sec) || !sec->include)
+			continue;
+		for_each_rela(rela, sec) {
+			if (sec == relasec && !p->keep[rela->offset])
+				continue;
+			if (rela->sym->sec == p->sec)
+				rela->addend = before[rela->addend];
+		}
+	}
+
+	if (relasec) {
+		for_each_rela(rela, relasec) {
+			if (!p->keep[rela->offset])
+				continue;
+			relasec->relas[nr] = *rela;
+			relasec->relas[nr].offset = before[rela->offset];
+			nr++;
+		}
+		relasec->nr_relas = nr;
+	}
+
+	p->sec->data->d_buf = newbuf;
+	p->sec->data->d_size = n;
+	p->sec->sh.sh_size = n;
+
+	free(before);
+	return 0;
+}
+
+static void kpatch_prune_debug_section(struct kpatch_elf *kelf,
+				       struct section *sec,
+				       int (*mark)(struct debug_prune *p))
+{
+	struct debug_prune p;
+	struct rela *rela;
+
+	memset(&p, 0, sizeof(p));
+	p.sec = sec;
+	p.buf = sec->data->d_buf;
+	p.size = sec->data->d_size;
+	p.keep = calloc(p.size, 1);
+	p.relas = calloc(p.size, sizeof(*p.relas));
+	if (!p.keep || !p.relas)
+		ERROR("calloc");
+
+	if (sec->rela) {
+		for_each_rela(rela, sec->rela) {
+			if (rela->offset < 0 || rela->offset >= p.size)
+				goto out;
+			p.relas[rela->offset] = rela;
+		}
+	}
+
+	if (mark(&p) || prune_section(kelf, &p))
+		log_debug("Can't prune %s, keeping all of it\n", sec->name);
+
+out:
+	free(p.keep);
+	free(p.relas);
+	free(p.units);
+}
+
+void kpatch_prune_debug_sections(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!sec->include || !sec->data || !sec->data->d_buf ||
+		    !sec->data->d_size)
+			continue;
+
+		if (!strcmp(sec->name, ".debug_frame"))
+			kpatch_prune_debug_section(kelf, sec, mark_debug_frame);
+		else if (!strcmp(sec->name, ".debug_aranges"))
+			kpatch_prune_debug_section(kelf, sec,
+						   mark_debug_aranges);
+		else if (!strcmp(sec->name, ".debug_line"))
+			kpatch_prune_debug_section(kelf, sec, mark_debug_line);
+	}
+}
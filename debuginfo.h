@@ -0,0 +1,13 @@
+#ifndef _DEBUGINFO_H_
+#define _DEBUGINFO_H_
+
+/*
+ * Drop the entries of the DWARF sections which describe code that isn't
+ * included: the FDEs of .debug_frame, the address ranges of .debug_aranges
+ * and the sequences of .debug_line.  Must be called once the included
+ * sections are known, and before the relas of the debug sections which
+ * reference non-included sections are stripped.
+ */
+void kpatch_prune_debug_sections(struct kpatch_elf *kelf);
+
+#endif /* _DEBUGINFO_H_ */
@@ -0,0 +1,580 @@
+/*
+ * Copyright (C) 2015 Ross Lagerwall <ross.lagerwall@citrix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is the compiler wrapper used by livepatch-build through
+ * CROSS_COMPILE.  It runs the real toolchain command and, for gcc
+ * invocations which produce an object, copies the object into
+ * LIVEPATCH_CAPTURE_DIR and records its path relative to
+ * LIVEPATCH_BUILD_DIR in LIVEPATCH_CAPTURE_DIR/changed_objs.
+ *
+ * It is run for every toolchain command of the Xen build, so it does all
+ * of this in-process.  Each record is appended with a single write() to an
+ * O_APPEND file so concurrent compiles under make -j cannot interleave.
+ *
+ * The flags in LIVEPATCH_EXTRA_CFLAGS are added to the hypervisor's own
+ * compiles, which are those using -nostdinc, so that the build does not
+ * need to be modified to use them.
+ *
+ * If LIVEPATCH_DIFF_QUEUE and LIVEPATCH_TWIN_DIR are set, an object whose
+ * other version has already been captured in LIVEPATCH_TWIN_DIR is also
+ * recorded in LIVEPATCH_DIFF_QUEUE, so that livepatch-build can diff it
+ * while the rest of the build is still running.
+ *
+ * If LIVEPATCH_CACHE_DIR is set, compiles of a single C file are looked up
+ * in a cache there first.  The key is a hash of the preprocessed source,
+ * the identity of the compiler, the full command line and the working
+ * directory.  Entries are written to a temporary file and renamed into
+ * place, so concurrent builds sharing a cache only ever see complete ones.
+ *
+ * Based on kpatch's kpatch-gcc script.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sha1.h"
+
+#define ERROR(format, ...) \
+	error(1, errno, "%s: %d: " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+
+/* Objects which are never part of a live patch */
+static const char *excluded[] = {
+	"version.o",
+	"debug.o",
+	"*.xen-syms.*.o",
+	".*.o",
+	NULL,
+};
+
+/*
+ * Return the object which this command line produces and which should be
+ * captured, or NULL.  Objects written to a .tmp_ file are renamed by the
+ * build afterwards, so the final name is returned for them.
+ */
+static char *find_object(int argc, char *argv[], char **output)
+{
+	static char obj[PATH_MAX];
+	const char **pattern;
+	char *tmp;
+	int i;
+
+	for (i = 0; i < argc - 1; i++)
+		if (!strcmp(argv[i], "-o"))
+			break;
+	if (i >= argc - 1)
+		return NULL;
+
+	*output = argv[i + 1];
+	if (snprintf(obj, sizeof(obj), "%s", *output) >= sizeof(obj))
+		return NULL;
+	if (!fnmatch("*/.tmp_*.o", obj, 0)) {
+		tmp = strstr(obj, ".tmp_");
+		memmove(tmp, tmp + strlen(".tmp_"), strlen(tmp + strlen(".tmp_")) + 1);
+	}
+
+	for (pattern = excluded; *pattern; pattern++)
+		if (!fnmatch(*pattern, obj, 0))
+			return NULL;
+	if (fnmatch("*.o", obj, 0))
+		return NULL;
+
+	return obj;
+}
+
+/* Remove empty, "." and ".." components from an absolute path, in place */
+static void clean_path(char *path)
+{
+	char *src = path, *dst = path;
+
+	while (*src) {
+		while (*src == '/')
+			src++;
+		if (!*src)
+			break;
+		if (src[0] == '.' && (src[1] == '/' || !src[1])) {
+			src++;
+			continue;
+		}
+		if (src[0] == '.' && src[1] == '.' && (src[2] == '/' || !src[2])) {
+			src += 2;
+			while (dst > path && *--dst != '/')
+				;
+			continue;
+		}
+		*dst++ = '/';
+		while (*src && *src != '/')
+			*dst++ = *src++;
+	}
+	if (dst == path)
+		*dst++ = '/';
+	*dst = '\0';
+}
+
+static void mkdir_parents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0777) && errno != EEXIST)
+			ERROR("mkdir %s", path);
+		*p = '/';
+	}
+}
+
+/* Return a copy of argv with the extra flags inserted after -nostdinc */
+static char **add_extra_cflags(int *argc, char *argv[], char *flags)
+{
+	char **args, *flag;
+	int i, n = 0, nr_flags = 0;
+
+	for (i = 0; i < *argc; i++)
+		if (!strcmp(argv[i], "-nostdinc"))
+			break;
+	if (i == *argc)
+		return argv;
+
+	flags = strdup(flags);
+	args = malloc((*argc + strlen(flags) / 2 + 2) * sizeof(*args));
+	if (!flags || !args)
+		ERROR("malloc");
+
+	memcpy(args, argv, (i + 1) * sizeof(*args));
+	n = i + 1;
+	for (flag = strtok(flags, " \t"); flag; flag = strtok(NULL, " \t")) {
+		args[n++] = flag;
+		nr_flags++;
+	}
+	memcpy(args + n, argv + i + 1, (*argc - i) * sizeof(*args));
+
+	*argc += nr_flags;
+	return args;
+}
+
+/* Options whose value is the next argument and never an input file */
+static const char *value_options[] = {
+	"-o", "-MF", "-MT", "-MQ", "-include", "-imacros", "-x", "-I",
+	"-isystem", "-iquote", "-idirafter", "-D", "-U", NULL,
+};
+
+static int is_value_option(const char *arg)
+{
+	const char **opt;
+
+	for (opt = value_options; *opt; opt++)
+		if (!strcmp(arg, *opt))
+			return 1;
+	return 0;
+}
+
+/*
+ * If this command line compiles a single C file to an object, return the
+ * file dependencies are written to, "" if there are none, or NULL if the
+ * result of the command cannot be cached.
+ */
+static char *cacheable(int argc, char *argv[])
+{
+	char *depfile = "";
+	int i, compile = 0, sources = 0, deps = 0;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-c"))
+			compile = 1;
+		else if (!strcmp(argv[i], "-MD") || !strcmp(argv[i], "-MMD"))
+			deps = 1;
+		else if (!strcmp(argv[i], "-MF") && i < argc - 1)
+			depfile = argv[i + 1];
+		else if (!strncmp(argv[i], "-Wp,", 4) || !strcmp(argv[i], "-x") ||
+			 !strcmp(argv[i], "-") || !strncmp(argv[i], "-save-temps", 11))
+			return NULL;
+
+		if (is_value_option(argv[i]))
+			i++;
+		else if (argv[i][0] != '-' && !fnmatch("*.c", argv[i], 0))
+			sources++;
+	}
+
+	if (!compile || sources != 1 || (deps && !*depfile))
+		return NULL;
+
+	return deps ? depfile : "";
+}
+
+/* Find the program which execvp() would run */
+static int find_program(const char *name, struct stat *st)
+{
+	char path[PATH_MAX];
+	const char *dirs, *end;
+
+	if (strchr(name, '/'))
+		return stat(name, st);
+
+	dirs = getenv("PATH");
+	if (!dirs)
+		dirs = "/bin:/usr/bin";
+	for (; *dirs; dirs = *end ? end + 1 : end) {
+		end = strchr(dirs, ':');
+		if (!end)
+			end = dirs + strlen(dirs);
+		if (snprintf(path, sizeof(path), "%.*s/%s", (int)(end - dirs),
+			     dirs, name) >= sizeof(path))
+			continue;
+		if (!stat(path, st) && S_ISREG(st->st_mode) && !access(path, X_OK))
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Compute the cache key of a compile.  The source is preprocessed with the
+ * same flags, minus those producing output, and hashed along with the
+ * compiler, the command line and the working directory, which ends up in
+ * the debug information.  Returns -1 if the source cannot be preprocessed.
+ */
+static int cache_key(int argc, char *argv[], char key[SHA1_DIGEST_SIZE * 2 + 1])
+{
+	unsigned char digest[SHA1_DIGEST_SIZE], buf[65536];
+	char cwd[PATH_MAX], **args;
+	struct sha1_ctx ctx;
+	struct stat st;
+	int i, n, fds[2], status;
+	ssize_t len;
+	pid_t pid;
+
+	if (find_program(argv[0], &st) || !getcwd(cwd, sizeof(cwd)))
+		return -1;
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, "livepatch-gcc cache 1", 22);
+	sha1_update(&ctx, &st.st_dev, sizeof(st.st_dev));
+	sha1_update(&ctx, &st.st_ino, sizeof(st.st_ino));
+	sha1_update(&ctx, &st.st_size, sizeof(st.st_size));
+	sha1_update(&ctx, &st.st_mtime, sizeof(st.st_mtime));
+	sha1_update(&ctx, cwd, strlen(cwd) + 1);
+	for (i = 0; i < argc; i++)
+		sha1_update(&ctx, argv[i], strlen(argv[i]) + 1);
+
+	args = malloc((argc + 2) * sizeof(*args));
+	if (!args)
+		ERROR("malloc");
+	for (i = 0, n = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "-MF") ||
+		    !strcmp(argv[i], "-MT") || !strcmp(argv[i], "-MQ")) {
+			i++;
+			continue;
+		}
+		if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-MD") ||
+		    !strcmp(argv[i], "-MMD") || !strcmp(argv[i], "-MP"))
+			continue;
+		args[n++] = argv[i];
+	}
+	args[n++] = "-E";
+	args[n] = NULL;
+
+	if (pipe(fds))
+		ERROR("pipe");
+	pid = fork();
+	if (pid == -1)
+		ERROR("fork");
+	if (!pid) {
+		close(fds[0]);
+		if (dup2(fds[1], STDOUT_FILENO) == -1)
+			_exit(127);
+		execvp(args[0], args);
+		_exit(127);
+	}
+	close(fds[1]);
+	free(args);
+
+	while ((len = read(fds[0], buf, sizeof(buf)))) {
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			ERROR("read");
+		}
+		sha1_update(&ctx, buf, len);
+	}
+	close(fds[0]);
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			ERROR("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+
+	sha1_final(&ctx, digest);
+	sha1_hex(digest, key);
+	return 0;
+}
+
+/*
+ * Copy a file, sharing its blocks with the original (reflink) if the file
+ * system supports it and else copying in the kernel if possible.  Files are
+ * never hard linked as the compiler and assembler rewrite their outputs in
+ * place, which would modify every link.
+ */
+static void copy_file(const char *src, const char *dst)
+{
+	char buf[65536];
+	ssize_t len, ret, off;
+	int in, out;
+
+	in = open(src, O_RDONLY);
+	if (in == -1)
+		ERROR("open %s", src);
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out == -1)
+		ERROR("open %s", dst);
+
+	if (!ioctl(out, FICLONE, in))
+		goto done;
+
+	while ((len = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+		;
+	if (!len)
+		goto done;
+	if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+	    errno != EOPNOTSUPP)
+		ERROR("copy_file_range %s", dst);
+
+	/* copy_file_range() moved both offsets, so carry on from there */
+	while ((len = read(in, buf, sizeof(buf)))) {
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			ERROR("read %s", src);
+		}
+		for (off = 0; off < len; off += ret) {
+			ret = write(out, buf + off, len - off);
+			if (ret == -1) {
+				if (errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				ERROR("write %s", dst);
+			}
+		}
+	}
+
+done:
+	if (close(out))
+		ERROR("close %s", dst);
+	close(in);
+}
+
+/* Copy a file such that dst is either absent or complete at all times */
+static void publish_file(const char *src, const char *dst)
+{
+	char tmp[PATH_MAX];
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dst, getpid()) >= sizeof(tmp))
+		ERROR("path too long: %s", dst);
+	copy_file(src, tmp);
+	if (rename(tmp, dst))
+		ERROR("rename %s", dst);
+}
+
+/*
+ * Restore the result of a compile from the cache.  Returns -1 if it is not
+ * there.
+ */
+static int cache_restore(const char *cachedir, const char *key,
+			 const char *output, const char *depfile)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s.o", cachedir, key);
+	if (access(path, R_OK))
+		return -1;
+	copy_file(path, output);
+
+	if (*depfile) {
+		snprintf(path, sizeof(path), "%s/%s.d", cachedir, key);
+		if (access(path, R_OK))
+			return -1;
+		copy_file(path, depfile);
+	}
+
+	return 0;
+}
+
+/*
+ * Add the result of a compile to the cache.  The object is added last as
+ * its presence marks the entry as complete.
+ */
+static void cache_store(const char *cachedir, const char *key,
+			const char *output, const char *depfile)
+{
+	char path[PATH_MAX];
+
+	if (*depfile) {
+		snprintf(path, sizeof(path), "%s/%s.d", cachedir, key);
+		publish_file(depfile, path);
+	}
+	snprintf(path, sizeof(path), "%s/%s.o", cachedir, key);
+	publish_file(output, path);
+}
+
+/* Append a record to a file with a single write() */
+static void append_record(const char *path, const char *record, int len)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (fd == -1)
+		ERROR("open %s", path);
+	if (write(fd, record, len) != len)
+		ERROR("write %s", path);
+	close(fd);
+}
+
+/*
+ * Copy the object into the capture directory and record it.  If the other
+ * version of the object has already been captured in LIVEPATCH_TWIN_DIR,
+ * the pair is complete and the object is also recorded in
+ * LIVEPATCH_DIFF_QUEUE.
+ */
+static void capture(const char *output, const char *obj,
+		    const char *builddir, const char *capturedir)
+{
+	char path[PATH_MAX], dst[PATH_MAX], record[PATH_MAX + 1];
+	size_t builddirlen = strlen(builddir);
+	char *rel, *queue, *twindir;
+	int len;
+
+	if (!getcwd(path, sizeof(path)))
+		ERROR("getcwd");
+	if (strlen(path) + strlen(obj) + 2 > sizeof(path))
+		ERROR("path too long: %s/%s", path, obj);
+	strcat(path, "/");
+	strcat(path, obj);
+	clean_path(path);
+
+	/* LIVEPATCH_BUILD_DIR has a trailing slash */
+	rel = path;
+	if (!strncmp(path, builddir, builddirlen))
+		rel += builddirlen;
+
+	/*
+	 * Published so that the twin check of a concurrent capture of the
+	 * other version never sees a partial object.
+	 */
+	if (snprintf(dst, sizeof(dst), "%s/%s", capturedir, rel) >= sizeof(dst))
+		ERROR("path too long: %s/%s", capturedir, rel);
+	mkdir_parents(dst);
+	publish_file(output, dst);
+
+	len = snprintf(record, sizeof(record), "%s\n", rel);
+	if (snprintf(dst, sizeof(dst), "%s/changed_objs", capturedir) >= sizeof(dst))
+		ERROR("path too long: %s/changed_objs", capturedir);
+	append_record(dst, record, len);
+
+	queue = getenv("LIVEPATCH_DIFF_QUEUE");
+	twindir = getenv("LIVEPATCH_TWIN_DIR");
+	if (!queue || !*queue || !twindir || !*twindir)
+		return;
+	if (snprintf(dst, sizeof(dst), "%s/%s", twindir, rel) >= sizeof(dst))
+		ERROR("path too long: %s/%s", twindir, rel);
+	if (!access(dst, R_OK))
+		append_record(queue, record, len);
+}
+
+int main(int argc, char *argv[])
+{
+	char *builddir, *capturedir, *cachedir, *obj = NULL, *output = NULL;
+	char *extra_cflags;
+	char key[SHA1_DIGEST_SIZE * 2 + 1], *depfile = NULL;
+	struct stat st;
+	int status;
+	pid_t pid;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: livepatch-gcc <command> [args...]\n");
+		return 1;
+	}
+
+	builddir = getenv("LIVEPATCH_BUILD_DIR");
+	capturedir = getenv("LIVEPATCH_CAPTURE_DIR");
+	cachedir = getenv("LIVEPATCH_CACHE_DIR");
+	extra_cflags = getenv("LIVEPATCH_EXTRA_CFLAGS");
+	if (!builddir)
+		builddir = "";
+
+	if (!strcmp(argv[1], "gcc")) {
+		if (extra_cflags && *extra_cflags)
+			argv = add_extra_cflags(&argc, argv, extra_cflags);
+		if (capturedir && *capturedir &&
+		    !stat(capturedir, &st) && S_ISDIR(st.st_mode))
+			obj = find_object(argc - 2, argv + 2, &output);
+		if (cachedir && *cachedir) {
+			depfile = cacheable(argc - 2, argv + 2);
+			if (depfile && !output)
+				find_object(argc - 2, argv + 2, &output);
+			if (!output || cache_key(argc - 1, argv + 1, key))
+				depfile = NULL;
+		}
+	}
+
+	if (!obj && !depfile) {
+		execvp(argv[1], argv + 1);
+		ERROR("exec %s", argv[1]);
+	}
+
+	if (depfile && !cache_restore(cachedir, key, output, depfile))
+		goto done;
+
+	pid = fork();
+	if (pid == -1)
+		ERROR("fork");
+	if (!pid) {
+		execvp(argv[1], argv + 1);
+		error(127, errno, "exec %s", argv[1]);
+	}
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			ERROR("waitpid");
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	if (WEXITSTATUS(status))
+		return WEXITSTATUS(status);
+
+	if (depfile)
+		cache_store(cachedir, key, output, depfile);
+
+done:
+	if (obj)
+		capture(output, obj, builddir, capturedir);
+
+	return 0;
+}
@@ -0,0 +1,642 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This tool links the objects generated by create-diff-object into a
+ * livepatch module.  It does the job of "ld -r --build-id=sha1" followed by
+ * adding the .livepatch.depends note with objcopy, but reads each object
+ * once and writes the module once.
+ *
+ * Sections with the same name are concatenated, local symbols are copied,
+ * global symbols are resolved against each other and relocations against
+ * section symbols are rebased to the offset of the input section within the
+ * output section.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <error.h>
+#include <unistd.h>
+#include <gelf.h>
+
+#include "list.h"
+#include "asm/insn.h"
+#include "common.h"
+#include "sha1.h"
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+char *childobj;
+enum loglevel loglevel = NORMAL;
+
+struct object {
+	char *path;
+	struct kpatch_elf *kelf;
+	/* offset of each input section in its output section, by index */
+	unsigned long *offsets;
+};
+
+static LIST_HEAD(section_symbols);
+static LIST_HEAD(local_symbols);
+static LIST_HEAD(global_symbols);
+
+static Elf_Data *new_data(Elf_Type type)
+{
+	Elf_Data *data;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		ERROR("malloc");
+	memset(data, 0, sizeof(*data));
+	data->d_type = type;
+
+	return data;
+}
+
+/* find or create the output section an input section is merged into */
+static struct section *output_section(struct kpatch_elf *kelf,
+				      struct section *in)
+{
+	struct section *sec;
+
+	sec = find_section_by_name(&kelf->sections, in->name);
+	if (sec) {
+		if (sec->sh.sh_type != in->sh.sh_type ||
+		    sec->sh.sh_flags != in->sh.sh_flags)
+			ERROR("section %s has conflicting type or flags",
+			      in->name);
+		if (sec->sh.sh_addralign < in->sh.sh_addralign)
+			sec->sh.sh_addralign = in->sh.sh_addralign;
+		return sec;
+	}
+
+	ALLOC_LINK(sec, &kelf->sections);
+	sec->name = in->name;
+	sec->sh = in->sh;
+	sec->sh.sh_offset = 0;
+	sec->sh.sh_size = 0;
+	sec->data = new_data(in->data->d_type);
+
+	return sec;
+}
+
+static void merge_sections(struct kpatch_elf *kelf, struct object *obj)
+{
+	struct section *in, *out;
+	unsigned long offset, align;
+	char *buf;
+
+	list_for_each_entry(in, &obj->kelf->sections, list) {
+		if (in->sh.sh_type == SHT_GROUP)
+			ERROR("unsupported group section %s", in->name);
+		if (in->sh.sh_link && !is_rela_section(in) &&
+		    in->sh.sh_type != SHT_SYMTAB)
+			ERROR("unsupported linked section %s", in->name);
+		if (!strcmp(in->name, ".note.gnu.build-id") ||
+		    !strcmp(in->name, ".livepatch.depends"))
+			ERROR("unexpected section %s", in->name);
+
+		out = output_section(kelf, in);
+		in->twin = out;
+
+		/* these are created from the relas and symbols later */
+		if (is_rela_section(in) || in->sh.sh_type == SHT_SYMTAB ||
+		    in->sh.sh_type == SHT_STRTAB)
+			continue;
+
+		align = in->sh.sh_addralign ? in->sh.sh_addralign : 1;
+		offset = ALIGN(out->sh.sh_size, align);
+
+		if (in->sh.sh_type != SHT_NOBITS) {
+			buf = realloc(out->data->d_buf, offset + in->sh.sh_size);
+			if (!buf && offset + in->sh.sh_size)
+				ERROR("realloc");
+			memset(buf + out->sh.sh_size, 0,
+			       offset - out->sh.sh_size);
+			memcpy(buf + offset, in->data->d_buf, in->sh.sh_size);
+			out->data->d_buf = buf;
+		}
+
+		out->sh.sh_size = offset + in->sh.sh_size;
+		out->data->d_size = out->sh.sh_size;
+		obj->offsets[in->index] = offset;
+
+		log_debug("%s: %s -> %s+0x%lx\n", obj->path, in->name,
+			  out->name, offset);
+	}
+}
+
+static void set_symbol(struct object *obj, struct symbol *out,
+		       struct symbol *in)
+{
+	out->name = in->name;
+	out->sym = in->sym;
+	out->type = in->type;
+	out->bind = in->bind;
+	out->sec = NULL;
+
+	if (in->sec) {
+		out->sec = in->sec->twin;
+		out->sym.st_value += obj->offsets[in->sec->index];
+	}
+}
+
+static struct symbol *section_symbol(struct section *sec)
+{
+	struct symbol *sym;
+
+	if (sec->secsym)
+		return sec->secsym;
+
+	ALLOC_LINK(sym, &section_symbols);
+	sym->name = sec->name;
+	sym->sec = sec;
+	sym->type = STT_SECTION;
+	sym->bind = STB_LOCAL;
+	sym->sym.st_info = GELF_ST_INFO(STB_LOCAL, STT_SECTION);
+	sec->secsym = sym;
+
+	return sym;
+}
+
+static struct symbol *global_symbol(struct object *obj, struct symbol *in)
+{
+	struct symbol *sym;
+
+	sym = find_symbol_by_name(&global_symbols, in->name);
+	if (!sym) {
+		ALLOC_LINK(sym, &global_symbols);
+		set_symbol(obj, sym, in);
+		return sym;
+	}
+
+	if (in->sym.st_shndx == SHN_UNDEF)
+		return sym;
+
+	if (sym->sym.st_shndx != SHN_UNDEF) {
+		if (in->bind == STB_WEAK)
+			return sym;
+		if (sym->bind != STB_WEAK)
+			ERROR("duplicate symbol %s", in->name);
+	}
+
+	/* replace an undefined or weak symbol with this definition */
+	set_symbol(obj, sym, in);
+
+	return sym;
+}
+
+static void link_symbols(struct object *obj)
+{
+	struct symbol *in, *out;
+
+	list_for_each_entry(in, &obj->kelf->symbols, list) {
+		/* the output has its own NULL symbol */
+		if (!in->index)
+			continue;
+
+		if (in->sym.st_shndx == SHN_COMMON)
+			ERROR("unsupported common symbol %s", in->name);
+
+		if (in->type == STT_SECTION) {
+			if (!in->sec)
+				ERROR("section symbol without section");
+			in->twin = section_symbol(in->sec->twin);
+		} else if (is_local_sym(in)) {
+			ALLOC_LINK(out, &local_symbols);
+			set_symbol(obj, out, in);
+			in->twin = out;
+		} else {
+			in->twin = global_symbol(obj, in);
+		}
+	}
+}
+
+static void link_relas(struct object *obj)
+{
+	struct section *in, *out;
+	struct rela *rela, *new;
+	unsigned long offset;
+
+	list_for_each_entry(in, &obj->kelf->sections, list) {
+		if (!is_rela_section(in))
+			continue;
+
+		out = in->twin;
+		out->base = in->base->twin;
+		out->base->rela = out;
+
+		out->relas = realloc(out->relas, (out->nr_relas + in->nr_relas) *
+				     sizeof(*out->relas));
+		if (!out->relas && in->nr_relas)
+			ERROR("realloc");
+
+		offset = obj->offsets[in->base->index];
+		for_each_rela(rela, in) {
+			new = &out->relas[out->nr_relas++];
+			*new = *rela;
+			new->sym = rela->sym->twin;
+			new->offset += offset;
+			new->string = NULL;
+			if (rela->sym->type == STT_SECTION)
+				new->addend += obj->offsets[rela->sym->sec->index];
+		}
+	}
+}
+
+static void move_symbols(struct list_head *src, struct list_head *dst)
+{
+	struct symbol *sym, *safe;
+
+	list_for_each_entry_safe(sym, safe, src, list) {
+		list_del(&sym->list);
+		list_add_tail(&sym->list, dst);
+	}
+}
+
+/* add a GNU note section at the start of the section list */
+static struct section *add_note_section(struct kpatch_elf *kelf, char *name,
+					const void *desc, size_t descsz)
+{
+	struct section *sec;
+	Elf64_Nhdr *nhdr;
+	size_t namesz = ALIGN(sizeof(ELF_NOTE_GNU), 4);
+	char *buf;
+
+	ALLOC_LINK(sec, &kelf->sections);
+	list_del(&sec->list);
+	list_add(&sec->list, &kelf->sections);
+
+	sec->name = name;
+	sec->sh.sh_type = SHT_NOTE;
+	sec->sh.sh_flags = SHF_ALLOC;
+	sec->sh.sh_addralign = 4;
+	sec->sh.sh_size = sizeof(*nhdr) + namesz + ALIGN(descsz, 4);
+
+	buf = malloc(sec->sh.sh_size);
+	if (!buf)
+		ERROR("malloc");
+	memset(buf, 0, sec->sh.sh_size);
+
+	nhdr = (Elf64_Nhdr *)buf;
+	nhdr->n_namesz = sizeof(ELF_NOTE_GNU);
+	nhdr->n_descsz = descsz;
+	nhdr->n_type = NT_GNU_BUILD_ID;
+	memcpy(buf + sizeof(*nhdr), ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU));
+	if (desc)
+		memcpy(buf + sizeof(*nhdr) + namesz, desc, descsz);
+
+	sec->data = new_data(ELF_T_BYTE);
+	sec->data->d_buf = buf;
+	sec->data->d_size = sec->sh.sh_size;
+
+	return sec;
+}
+
+/*
+ * Like ld, hash the module with the build-id zeroed.  The section headers
+ * and data are hashed rather than the file, which is only laid out by
+ * libelf when it is written.
+ */
+static void set_build_id(struct kpatch_elf *kelf, struct section *note)
+{
+	unsigned char *desc = note->data->d_buf + note->data->d_size -
+			      SHA1_DIGEST_SIZE;
+	struct sha1_ctx ctx;
+	struct section *sec;
+	char hex[SHA1_DIGEST_SIZE * 2 + 1];
+
+	sha1_init(&ctx);
+	list_for_each_entry(sec, &kelf->sections, list) {
+		sha1_update(&ctx, sec->name, strlen(sec->name) + 1);
+		sha1_update(&ctx, &sec->sh.sh_type, sizeof(sec->sh.sh_type));
+		sha1_update(&ctx, &sec->sh.sh_flags, sizeof(sec->sh.sh_flags));
+		sha1_update(&ctx, &sec->data->d_size, sizeof(sec->data->d_size));
+		if (sec->sh.sh_type != SHT_NOBITS && sec->data->d_size)
+			sha1_update(&ctx, sec->data->d_buf, sec->data->d_size);
+	}
+	sha1_final(&ctx, desc);
+
+	sha1_hex(desc, hex);
+	log_debug("build-id %s\n", hex);
+}
+
+/*
+ * Take the .debug_* sections, their rela sections and their section symbols
+ * out of kelf, onto the given lists.
+ */
+static void remove_debug_sections(struct kpatch_elf *kelf,
+				  struct list_head *sections,
+				  struct list_head *symbols)
+{
+	struct section *sec, *safesec;
+	struct symbol *sym, *safesym;
+
+	list_for_each_entry_safe(sym, safesym, &kelf->symbols, list) {
+		if (!sym->sec || !is_debug_section(sym->sec))
+			continue;
+		list_del(&sym->list);
+		list_add_tail(&sym->list, symbols);
+	}
+
+	list_for_each_entry_safe(sec, safesec, &kelf->sections, list) {
+		if (!is_debug_section(sec))
+			continue;
+		list_del(&sec->list);
+		list_add_tail(&sec->list, sections);
+	}
+}
+
+/*
+ * Turn the module into its debug file, the counterpart of
+ * "objcopy --only-keep-debug": put back the debug sections taken out by
+ * remove_debug_sections(), and keep only the headers of the other sections
+ * but for the notes and the symbol and string tables.  The relocations of
+ * the sections left without contents are dropped.
+ */
+static void make_debug_file(struct kpatch_elf *kelf,
+			    struct list_head *sections,
+			    struct list_head *symbols)
+{
+	struct section *sec, *safesec;
+	struct symbol *sym, *safesym, *prev;
+
+	list_for_each_entry_safe(sec, safesec, &kelf->sections, list) {
+		if (is_rela_section(sec)) {
+			list_del(&sec->list);
+			continue;
+		}
+		if (sec->sh.sh_type == SHT_NOTE ||
+		    sec->sh.sh_type == SHT_SYMTAB ||
+		    sec->sh.sh_type == SHT_STRTAB)
+			continue;
+		sec->sh.sh_type = SHT_NOBITS;
+		sec->data->d_buf = NULL;
+	}
+
+	list_for_each_entry_safe(sec, safesec, sections, list) {
+		list_del(&sec->list);
+		list_add_tail(&sec->list, &kelf->sections);
+	}
+
+	/* the section symbols go back with the locals, after the NULL one */
+	prev = list_first_entry(&kelf->symbols, struct symbol, list);
+	list_for_each_entry_safe(sym, safesym, symbols, list) {
+		list_del(&sym->list);
+		list_add(&sym->list, &prev->list);
+		prev = sym;
+	}
+}
+
+/* Index the elements and build the rela, string and symbol tables */
+static void finalize(struct kpatch_elf *kelf)
+{
+	struct section *sec, *symtab;
+
+	log_debug("Reindex elements\n");
+	kpatch_reindex_elements(kelf);
+
+	symtab = find_section_by_name(&kelf->sections, ".symtab");
+	if (!symtab)
+		ERROR("missing symbol table");
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!is_rela_section(sec))
+			continue;
+		sec->sh.sh_link = symtab->index;
+		sec->sh.sh_info = sec->base->index;
+		log_debug("Rebuild rela section data for %s\n", sec->name);
+		kpatch_rebuild_rela_section_data(sec);
+	}
+
+	log_debug("Create shstrtab\n");
+	kpatch_create_shstrtab(kelf);
+	log_debug("Create strtab\n");
+	kpatch_create_strtab(kelf);
+	log_debug("Create symtab\n");
+	kpatch_create_symtab(kelf);
+}
+
+struct arguments {
+	char *output;
+	char **inputs;
+	int nr_inputs;
+	unsigned char *depends;
+	size_t depends_size;
+	int debug;
+	int debug_info;
+};
+
+static char args_doc[] = "output.livepatch input.o...";
+
+static struct argp_option options[] = {
+	{"debug", 'd', 0, 0, "Show debug output" },
+	{"depends", 'D', "BUILD-ID", 0,
+	 "Add a .livepatch.depends note with the given build-id" },
+	{"debug-info", 'g', "POLICY", 0,
+	 "Keep, strip, compress (compress=zlib or compress=zstd) the debug "
+	 "sections, or split them into OUTPUT.debug" },
+	{ 0 }
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	/* Get the input argument from argp_parse, which we
+	   know is a pointer to our arguments structure. */
+	struct arguments *arguments = state->input;
+	size_t i, len;
+
+	switch (key)
+	{
+		case 'd':
+			arguments->debug = 1;
+			break;
+		case 'D':
+			len = strlen(arg);
+			if (!len || len % 2 ||
+			    strspn(arg, "0123456789abcdefABCDEF") != len)
+				argp_error(state, "invalid build-id %s", arg);
+			arguments->depends_size = len / 2;
+			arguments->depends = malloc(len / 2);
+			if (!arguments->depends)
+				ERROR("malloc");
+			for (i = 0; i < len / 2; i++)
+				sscanf(arg + i * 2, "%2hhx",
+				       &arguments->depends[i]);
+			break;
+		case 'g':
+			arguments->debug_info = kpatch_parse_debug_info(arg);
+			if (arguments->debug_info < 0)
+				argp_error(state, "invalid debug info policy %s",
+					   arg);
+			break;
+		case ARGP_KEY_ARGS:
+			arguments->output = state->argv[state->next];
+			arguments->inputs = state->argv + state->next + 1;
+			arguments->nr_inputs = state->argc - state->next - 1;
+			break;
+		case ARGP_KEY_END:
+			if (arguments->nr_inputs < 1)
+				/* Not enough arguments. */
+				argp_usage (state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, 0 };
+
+int main(int argc, char *argv[])
+{
+	struct kpatch_elf *kelf;
+	struct arguments arguments;
+	struct object *objs, *obj;
+	struct section *sec, *build_id;
+	struct symbol *sym;
+	LIST_HEAD(debug_sections);
+	LIST_HEAD(debug_symbols);
+	char *debug_file;
+	int i, nr;
+
+	memset(&arguments, 0, sizeof(arguments));
+	argp_parse (&argp, argc, argv, 0, 0, &arguments);
+	if (arguments.debug)
+		loglevel = DEBUG;
+
+	elf_version(EV_CURRENT);
+
+	kelf = malloc(sizeof(*kelf));
+	if (!kelf)
+		ERROR("malloc");
+	memset(kelf, 0, sizeof(*kelf));
+	INIT_LIST_HEAD(&kelf->sections);
+	INIT_LIST_HEAD(&kelf->symbols);
+	INIT_LIST_HEAD(&kelf->strings);
+	kelf->fd = -1;
+
+	objs = malloc(arguments.nr_inputs * sizeof(*objs));
+	if (!objs)
+		ERROR("malloc");
+	memset(objs, 0, arguments.nr_inputs * sizeof(*objs));
+
+	for (i = 0; i < arguments.nr_inputs; i++) {
+		obj = &objs[i];
+		obj->path = arguments.inputs[i];
+		childobj = obj->path;
+
+		log_debug("Open %s\n", obj->path);
+		obj->kelf = kpatch_elf_open(obj->path);
+
+		if (!i)
+			kelf->ehdr = obj->kelf->ehdr;
+		else if (obj->kelf->ehdr.e_ident[EI_CLASS] !=
+			 kelf->ehdr.e_ident[EI_CLASS] ||
+			 obj->kelf->ehdr.e_ident[EI_DATA] !=
+			 kelf->ehdr.e_ident[EI_DATA] ||
+			 obj->kelf->ehdr.e_machine != kelf->ehdr.e_machine)
+			ERROR("ELF header differs from %s", objs[0].path);
+
+		nr = 0;
+		list_for_each_entry(sec, &obj->kelf->sections, list) {
+			kpatch_elf_load_section(obj->kelf, sec);
+			if (sec->index > nr)
+				nr = sec->index;
+		}
+
+		obj->offsets = malloc((nr + 1) * sizeof(*obj->offsets));
+		if (!obj->offsets)
+			ERROR("malloc");
+		memset(obj->offsets, 0, (nr + 1) * sizeof(*obj->offsets));
+
+		log_debug("Merge sections\n");
+		merge_sections(kelf, obj);
+		log_debug("Link symbols\n");
+		link_symbols(obj);
+	}
+
+	for (i = 0; i < arguments.nr_inputs; i++) {
+		childobj = objs[i].path;
+		log_debug("Link relas of %s\n", objs[i].path);
+		link_relas(&objs[i]);
+	}
+	childobj = arguments.output;
+
+	if (arguments.depends)
+		add_note_section(kelf, ".livepatch.depends",
+				 arguments.depends, arguments.depends_size);
+	build_id = add_note_section(kelf, ".note.gnu.build-id", NULL,
+				    SHA1_DIGEST_SIZE);
+
+	/*
+	 * The NULL symbol, then the section symbols and the local symbols in
+	 * input order, so that each object's locals still follow its FILE
+	 * symbol, then the globals.
+	 */
+	ALLOC_LINK(sym, &kelf->symbols);
+	sym->name = "";
+	move_symbols(&section_symbols, &kelf->symbols);
+	move_symbols(&local_symbols, &kelf->symbols);
+	move_symbols(&global_symbols, &kelf->symbols);
+
+	finalize(kelf);
+
+	/*
+	 * The build-id covers the debug sections whatever is done with them,
+	 * so that the module and its debug file share it.
+	 */
+	log_debug("Set build-id\n");
+	set_build_id(kelf, build_id);
+
+	if (arguments.debug_info == DEBUG_INFO_STRIP ||
+	    arguments.debug_info == DEBUG_INFO_SPLIT) {
+		log_debug("Remove debug sections\n");
+		remove_debug_sections(kelf, &debug_sections, &debug_symbols);
+		finalize(kelf);
+	}
+
+	log_debug("Dump elf status\n");
+	kpatch_dump_kelf(kelf);
+
+	log_debug("Write out elf\n");
+	kpatch_write_output_elf(kelf, arguments.output,
+			kpatch_debug_info_compression(arguments.debug_info));
+
+	if (arguments.debug_info == DEBUG_INFO_SPLIT) {
+		if (asprintf(&debug_file, "%s.debug", arguments.output) < 0)
+			ERROR("asprintf");
+		childobj = debug_file;
+		log_debug("Make debug file\n");
+		make_debug_file(kelf, &debug_sections, &debug_symbols);
+		finalize(kelf);
+		log_debug("Write out debug file\n");
+		kpatch_write_output_elf(kelf, debug_file, 0);
+		free(debug_file);
+	}
+
+	for (i = 0; i < arguments.nr_inputs; i++) {
+		kpatch_elf_teardown(objs[i].kelf);
+		kpatch_elf_free(objs[i].kelf);
+		free(objs[i].offsets);
+	}
+	free(objs);
+
+	return 0;
+}
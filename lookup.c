@@ -53,7 +53,11 @@ struct lookup_table {
 #define for_each_symbol(ndx, iter, table) \
 	for (ndx = 0, iter = table->syms; ndx < table->nr; ndx++, iter++)
 
-struct lookup_table *lookup_open(char *path)
+/*
+ * Load the symbol table of the ELF file at path.  Returns NULL and sets why
+ * to the reason if it can't be loaded.
+ */
+struct lookup_table *lookup_try_open(char *path, const char **why)
 {
 	Elf *elf;
 	int fd, i, len;
@@ -62,43 +66,56 @@ struct lookup_table *lookup_open(char *path)
 	GElf_Sym sym;
 	Elf_Data *data;
 	char *name;
-	struct lookup_table *table;
+	struct lookup_table *table = NULL;
 	struct symbol *mysym;
 	size_t shstrndx;
 
-	if ((fd = open(path, O_RDONLY, 0)) < 0)
-		ERROR("open");
+	if ((fd = open(path, O_RDONLY, 0)) < 0) {
+		*why = "open";
+		return NULL;
+	}
 
 	elf_version(EV_CURRENT);
 
 	elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
 	if (!elf) {
-		printf("%s\n", elf_errmsg(-1));
-		ERROR("elf_begin");
+		*why = "elf_begin";
+		close(fd);
+		return NULL;
 	}
 
-	if (elf_getshdrstrndx(elf, &shstrndx))
-		ERROR("elf_getshdrstrndx");
+	if (elf_getshdrstrndx(elf, &shstrndx)) {
+		*why = "elf_getshdrstrndx";
+		goto err;
+	}
 
 	scn = NULL;
 	while ((scn = elf_nextscn(elf, scn))) {
-		if (!gelf_getshdr(scn, &sh))
-			ERROR("gelf_getshdr");
+		if (!gelf_getshdr(scn, &sh)) {
+			*why = "gelf_getshdr";
+			goto err;
+		}
 
 		name = elf_strptr(elf, shstrndx, sh.sh_name);
-		if (!name)
-			ERROR("elf_strptr scn");
+		if (!name) {
+			*why = "elf_strptr scn";
+			goto err;
+		}
 
 		if (!strcmp(name, ".symtab"))
 			break;
 	}
 
-	if (!scn)
-		ERROR(".symtab section not found");
+	if (!scn) {
+		*why = ".symtab section not found";
+		goto err;
+	}
 
 	data = elf_getdata(scn, NULL);
-	if (!data)
-		ERROR("elf_getdata");
+	if (!data || !sh.sh_entsize) {
+		*why = "elf_getdata";
+		goto err;
+	}
 
 	len = sh.sh_size / sh.sh_entsize;
 
@@ -114,8 +131,10 @@ struct lookup_table *lookup_open(char *path)
 	table->elf = elf;
 
 	for_each_symbol(i, mysym, table) {
-		if (!gelf_getsym(data, i, &sym))
-			ERROR("gelf_getsym");
+		if (!gelf_getsym(data, i, &sym)) {
+			*why = "gelf_getsym";
+			goto err;
+		}
 
 		if (sym.st_shndx == SHN_UNDEF) {
 			mysym->skip = 1;
@@ -123,8 +142,10 @@ struct lookup_table *lookup_open(char *path)
 		}
 
 		name = elf_strptr(elf, sh.sh_link, sym.st_name);
-		if(!name)
-			ERROR("elf_strptr sym");
+		if(!name) {
+			*why = "elf_strptr sym";
+			goto err;
+		}
 
 		mysym->value = sym.st_value;
 		mysym->size = sym.st_size;
@@ -134,12 +155,34 @@ struct lookup_table *lookup_open(char *path)
 	}
 
 	return table;
+
+err:
+	if (table) {
+		free(table->syms);
+		free(table);
+	}
+	elf_end(elf);
+	close(fd);
+	return NULL;
+}
+
+struct lookup_table *lookup_open(char *path)
+{
+	struct lookup_table *table;
+	const char *why;
+
+	table = lookup_try_open(path, &why);
+	if (!table)
+		ERROR("%s", why);
+
+	return table;
 }
 
 void lookup_close(struct lookup_table *table)
 {
 	elf_end(table->elf);
 	close(table->fd);
+	free(table->syms);
 	free(table);
 }
 
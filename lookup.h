@@ -9,6 +9,7 @@ struct lookup_result {
 };
 
 struct lookup_table *lookup_open(char *path);
+struct lookup_table *lookup_try_open(char *path, const char **why);
 void lookup_close(struct lookup_table *table);
 int lookup_local_symbol(struct lookup_table *table, char *name, char *hint,
                         struct lookup_result *result);
@@ -0,0 +1,486 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Serialized kpatch_elf models, see model.h.
+ *
+ * A model file is a struct model_hdr, followed by the arrays of sections,
+ * section data descriptors, symbols and relas, and then by the names and
+ * section contents they point to.  The elements are stored as they are in
+ * memory, except that their pointers hold references: an index + 1 into the
+ * array of what they point to, or a file offset for names, section contents
+ * and rela strings.  0 is NULL either way.  The list heads are not stored,
+ * the lists are rebuilt from the arrays, in the same order.
+ *
+ * The key covers the create-diff-object binary, so a model is never read by
+ * a build of the tool which lays out or loads the elements differently.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gelf.h>
+
+#include "list.h"
+#include "asm/insn.h"
+#include "common.h"
+#include "model.h"
+
+#define MODEL_MAGIC "KPMODEL1"
+
+struct model_hdr {
+	char magic[8];
+	uint64_t size;
+	GElf_Ehdr ehdr;
+	uint32_t nr_sections;
+	uint32_t nr_datas;
+	uint32_t nr_symbols;
+	uint32_t nr_relas;
+	/* file offsets of the arrays */
+	uint64_t sections;
+	uint64_t datas;
+	uint64_t symbols;
+	uint64_t relas;
+};
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+static int hash_file(struct sha1_ctx *ctx, const char *path)
+{
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		sha1_update(ctx, buf, n);
+	close(fd);
+
+	return n ? -1 : 0;
+}
+
+int kpatch_model_key(const char *path, char key[MODEL_KEY_SIZE])
+{
+	static unsigned char exe[SHA1_DIGEST_SIZE];
+	static int exe_hashed;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	struct sha1_ctx ctx;
+
+	if (!exe_hashed) {
+		sha1_init(&ctx);
+		if (hash_file(&ctx, "/proc/self/exe"))
+			return -1;
+		sha1_final(&ctx, exe);
+		exe_hashed = 1;
+	}
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+	sha1_update(&ctx, exe, sizeof(exe));
+	if (hash_file(&ctx, path))
+		return -1;
+	sha1_final(&ctx, digest);
+	sha1_hex(digest, key);
+
+	return 0;
+}
+
+static char *model_path(const char *dir, const char *key, const char *suffix)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s%s", dir, key, suffix) == -1)
+		ERROR("asprintf");
+	return path;
+}
+
+/* Turn a reference back into a pointer, or fail the load */
+#define FIXUP(ptr, array, nr) \
+({ \
+	uintptr_t __ref = (uintptr_t)(ptr); \
+	if (__ref > (nr)) \
+		goto corrupt; \
+	(ptr) = __ref ? (void *)&(array)[__ref - 1] : NULL; \
+})
+
+#define FIXUP_OFFSET(ptr, map, size) \
+({ \
+	uintptr_t __off = (uintptr_t)(ptr); \
+	if (__off >= (size)) \
+		goto corrupt; \
+	(ptr) = __off ? (void *)((char *)(map) + __off) : NULL; \
+})
+
+struct kpatch_elf *kpatch_model_load(const char *dir, const char *key)
+{
+	struct kpatch_elf *kelf = NULL;
+	struct model_hdr *hdr;
+	struct section *secs, *sec;
+	struct symbol *syms, *sym;
+	struct rela *relas, *rela;
+	Elf_Data *datas, *data;
+	struct stat st;
+	char *path;
+	void *map;
+	int fd;
+
+	path = model_path(dir, key, ".model");
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	/* private and writable, the diff modifies the elements in place */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (memcmp(hdr->magic, MODEL_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->size != st.st_size ||
+	    hdr->sections + hdr->nr_sections * sizeof(*secs) > st.st_size ||
+	    hdr->datas + hdr->nr_datas * sizeof(*datas) > st.st_size ||
+	    hdr->symbols + hdr->nr_symbols * sizeof(*syms) > st.st_size ||
+	    hdr->relas + hdr->nr_relas * sizeof(*relas) > st.st_size)
+		goto corrupt;
+	secs = map + hdr->sections;
+	datas = map + hdr->datas;
+	syms = map + hdr->symbols;
+	relas = map + hdr->relas;
+
+	kelf = malloc(sizeof(*kelf));
+	if (!kelf)
+		ERROR("malloc");
+	memset(kelf, 0, sizeof(*kelf));
+	INIT_LIST_HEAD(&kelf->sections);
+	INIT_LIST_HEAD(&kelf->symbols);
+	INIT_LIST_HEAD(&kelf->strings);
+	kelf->fd = -1;
+	kelf->ehdr = hdr->ehdr;
+	kelf->map = map;
+	kelf->map_size = st.st_size;
+
+	for (data = datas; data < datas + hdr->nr_datas; data++)
+		FIXUP_OFFSET(data->d_buf, map, st.st_size);
+
+	for (sec = secs; sec < secs + hdr->nr_sections; sec++) {
+		FIXUP_OFFSET(sec->name, map, st.st_size);
+		FIXUP(sec->data, datas, hdr->nr_datas);
+		if (is_rela_section(sec)) {
+			FIXUP(sec->base, secs, hdr->nr_sections);
+			FIXUP(sec->relas, relas, hdr->nr_relas);
+			if (sec->relas &&
+			    sec->relas + sec->nr_relas > relas + hdr->nr_relas)
+				goto corrupt;
+		} else {
+			FIXUP(sec->rela, secs, hdr->nr_sections);
+			FIXUP(sec->secsym, syms, hdr->nr_symbols);
+			FIXUP(sec->sym, syms, hdr->nr_symbols);
+		}
+		list_add_tail(&sec->list, &kelf->sections);
+	}
+
+	for (sym = syms; sym < syms + hdr->nr_symbols; sym++) {
+		FIXUP_OFFSET(sym->name, map, st.st_size);
+		FIXUP(sym->sec, secs, hdr->nr_sections);
+		list_add_tail(&sym->list, &kelf->symbols);
+	}
+
+	for (rela = relas; rela < relas + hdr->nr_relas; rela++) {
+		FIXUP(rela->sym, syms, hdr->nr_symbols);
+		FIXUP_OFFSET(rela->string, map, st.st_size);
+	}
+
+	return kelf;
+
+corrupt:
+	log_debug("ignoring corrupt cached model %s\n", key);
+	free(kelf);
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+/*
+ * Map the sections and symbols to their position in the arrays, through
+ * their index.  Returns NULL if an index is out of range or used twice.
+ */
+static int *position_map(struct kpatch_elf *kelf, int symbols, int *nr)
+{
+	struct section *sec;
+	struct symbol *sym;
+	int *map, max = 0, i = 0;
+
+	if (symbols) {
+		list_for_each_entry(sym, &kelf->symbols, list)
+			if (sym->index > max)
+				max = sym->index;
+	} else {
+		list_for_each_entry(sec, &kelf->sections, list)
+			if (sec->index > max)
+				max = sec->index;
+	}
+
+	map = malloc((max + 1) * sizeof(*map));
+	if (!map)
+		ERROR("malloc");
+	memset(map, -1, (max + 1) * sizeof(*map));
+
+	if (symbols) {
+		list_for_each_entry(sym, &kelf->symbols, list) {
+			if (sym->index < 0 || map[sym->index] != -1)
+				goto err;
+			map[sym->index] = i++;
+		}
+	} else {
+		list_for_each_entry(sec, &kelf->sections, list) {
+			if (sec->index < 0 || map[sec->index] != -1)
+				goto err;
+			map[sec->index] = i++;
+		}
+	}
+	*nr = i;
+	return map;
+
+err:
+	free(map);
+	return NULL;
+}
+
+/* Find the string section which a rela string points into */
+static struct section *string_section(struct kpatch_elf *kelf, char *string)
+{
+	struct section *sec;
+	char *start;
+
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (!(sec->sh.sh_flags & SHF_STRINGS) || !sec->data ||
+		    !sec->data->d_buf)
+			continue;
+		start = sec->data->d_buf;
+		if (string >= start && string < start + sec->data->d_size)
+			return sec;
+	}
+
+	return NULL;
+}
+
+/* Write the model to a new temporary file, whose name is left in tmp */
+static int write_model(char *tmp, void *buf, size_t size)
+{
+	char *p = buf;
+	ssize_t n;
+	int fd;
+
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+	if (fchmod(fd, 0644)) {
+		close(fd);
+		return -1;
+	}
+	while (size) {
+		n = write(fd, p, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return close(fd);
+}
+
+void kpatch_model_save(const char *dir, const char *key,
+		       struct kpatch_elf *kelf)
+{
+	struct model_hdr *hdr;
+	struct section *sec, *osec, *ssec;
+	struct symbol *sym, *osym;
+	struct rela *rela, *orela;
+	Elf_Data *odata;
+	int *secpos = NULL, *sympos = NULL;
+	uint64_t *dataoff = NULL;
+	int nr_sections, nr_symbols, nr_datas = 0, nr_relas = 0, i;
+	uint64_t size, blob;
+	char *buf = NULL, *path, *tmp;
+
+	secpos = position_map(kelf, 0, &nr_sections);
+	sympos = position_map(kelf, 1, &nr_symbols);
+	if (!secpos || !sympos) {
+		log_debug("not caching model of %s: bad indexes\n", childobj);
+		goto out;
+	}
+	dataoff = malloc((nr_sections + 1) * sizeof(*dataoff));
+	if (!dataoff)
+		ERROR("malloc");
+
+	/* lay out the file */
+	size = sizeof(*hdr);
+	list_for_each_entry(sec, &kelf->sections, list) {
+		if (sec->data)
+			nr_datas++;
+		if (is_rela_section(sec))
+			nr_relas += sec->nr_relas;
+	}
+	size = ALIGN(size, 8);
+	size += nr_sections * sizeof(struct section);
+	size += nr_datas * sizeof(Elf_Data);
+	size += nr_symbols * sizeof(struct symbol);
+	size += nr_relas * sizeof(struct rela);
+	blob = size;
+	list_for_each_entry(sec, &kelf->sections, list) {
+		size += strlen(sec->name) + 1;
+		if (sec->data && sec->data->d_buf) {
+			size = ALIGN(size, 16);
+			size += sec->data->d_size;
+		}
+	}
+	list_for_each_entry(sym, &kelf->symbols, list)
+		size += strlen(sym->name) + 1;
+
+	buf = malloc(size);
+	if (!buf)
+		ERROR("malloc");
+	memset(buf, 0, size);
+
+	hdr = (struct model_hdr *)buf;
+	memcpy(hdr->magic, MODEL_MAGIC, sizeof(hdr->magic));
+	hdr->size = size;
+	hdr->ehdr = kelf->ehdr;
+	hdr->nr_sections = nr_sections;
+	hdr->nr_datas = nr_datas;
+	hdr->nr_symbols = nr_symbols;
+	hdr->nr_relas = nr_relas;
+	hdr->sections = ALIGN(sizeof(*hdr), 8);
+	hdr->datas = hdr->sections + nr_sections * sizeof(struct section);
+	hdr->symbols = hdr->datas + nr_datas * sizeof(Elf_Data);
+	hdr->relas = hdr->symbols + nr_symbols * sizeof(struct symbol);
+
+#define SECREF(s) ((void *)(uintptr_t)((s) ? secpos[(s)->index] + 1 : 0))
+#define SYMREF(s) ((void *)(uintptr_t)((s) ? sympos[(s)->index] + 1 : 0))
+
+	/* copy the names and contents, then the elements */
+	i = 0;
+	osec = (struct section *)(buf + hdr->sections);
+	odata = (Elf_Data *)(buf + hdr->datas);
+	list_for_each_entry(sec, &kelf->sections, list) {
+		*osec = *sec;
+		memset(&osec->list, 0, sizeof(osec->list));
+		osec->twin = NULL;
+		osec->name = (void *)(uintptr_t)blob;
+		blob = stpcpy(buf + blob, sec->name) + 1 - buf;
+
+		if (sec->data) {
+			*odata = *sec->data;
+			if (sec->data->d_buf) {
+				blob = ALIGN(blob, 16);
+				memcpy(buf + blob, sec->data->d_buf,
+				       sec->data->d_size);
+				odata->d_buf = (void *)(uintptr_t)blob;
+				dataoff[secpos[sec->index]] = blob;
+				blob += sec->data->d_size;
+			}
+			osec->data = (void *)(uintptr_t)++i;
+			odata++;
+		}
+
+		if (is_rela_section(sec)) {
+			osec->base = SECREF(sec->base);
+			osec->relas = NULL;
+		} else {
+			osec->rela = SECREF(sec->rela);
+			osec->secsym = SYMREF(sec->secsym);
+			osec->sym = SYMREF(sec->sym);
+		}
+		osec++;
+	}
+
+	osym = (struct symbol *)(buf + hdr->symbols);
+	list_for_each_entry(sym, &kelf->symbols, list) {
+		*osym = *sym;
+		memset(&osym->list, 0, sizeof(osym->list));
+		osym->twin = NULL;
+		osym->sec = SECREF(sym->sec);
+		osym->name = (void *)(uintptr_t)blob;
+		blob = stpcpy(buf + blob, sym->name) + 1 - buf;
+		osym++;
+	}
+
+	i = 0;
+	osec = (struct section *)(buf + hdr->sections);
+	orela = (struct rela *)(buf + hdr->relas);
+	list_for_each_entry(sec, &kelf->sections, list) {
+		/* an empty rela section has a malloc(0) array, keep it NULL */
+		if (!is_rela_section(sec) || !sec->nr_relas) {
+			osec++;
+			continue;
+		}
+		osec->relas = (void *)(uintptr_t)(i + 1);
+		for_each_rela(rela, sec) {
+			*orela = *rela;
+			orela->sym = SYMREF(rela->sym);
+			if (rela->string) {
+				ssec = string_section(kelf, rela->string);
+				if (!ssec) {
+					log_debug("not caching model of %s: rela string outside of its section\n",
+						  childobj);
+					goto out;
+				}
+				orela->string = (void *)(uintptr_t)
+					(dataoff[secpos[ssec->index]] +
+					 (rela->string -
+					  (char *)ssec->data->d_buf));
+			}
+			orela++;
+			i++;
+		}
+		osec++;
+	}
+
+	/* publish it in one go, concurrent writers produce the same file */
+	mkdir(dir, 0777);
+	path = model_path(dir, key, ".model");
+	tmp = model_path(dir, key, ".tmp.XXXXXX");
+	if (!write_model(tmp, buf, size) && !rename(tmp, path))
+		log_debug("Cached model of %s as %s\n", childobj, key);
+	else
+		unlink(tmp);
+	free(tmp);
+	free(path);
+
+out:
+	free(buf);
+	free(dataoff);
+	free(secpos);
+	free(sympos);
+}
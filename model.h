@@ -0,0 +1,28 @@
+#ifndef _MODEL_H_
+#define _MODEL_H_
+
+#include "sha1.h"
+
+/*
+ * A cache of loaded objects: the kpatch_elf model of an object, as left by
+ * kpatch_elf_open() and kpatch_replace_sections_syms(), serialized to a file
+ * named after the hash of the object and of the tool.  Loading it back maps
+ * the file and fixes up the pointers, rather than parsing the object again.
+ *
+ * A model loaded from the cache has no Elf object behind it, so the sections
+ * whose reading was deferred (the .debug_* sections) can't be loaded.  It is
+ * meant for the original object of a diff, which never needs them.
+ */
+#define MODEL_KEY_SIZE (SHA1_DIGEST_SIZE * 2 + 1)
+
+/* Compute the cache key of the object at path, returns -1 on error */
+int kpatch_model_key(const char *path, char key[MODEL_KEY_SIZE]);
+
+/* Returns the cached model for key in dir, or NULL if there is none */
+struct kpatch_elf *kpatch_model_load(const char *dir, const char *key);
+
+/* Cache the model of a freshly loaded object, failures are not fatal */
+void kpatch_model_save(const char *dir, const char *key,
+		       struct kpatch_elf *kelf);
+
+#endif /* _MODEL_H_ */
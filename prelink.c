@@ -94,12 +94,16 @@ void livepatch_resolve_symbols(struct kpatch_elf *kelf,
 struct arguments {
 	char *args[3];
 	int debug;
+	int debug_info;
 };
 
 static char args_doc[] = "original.o resolved.o xen-syms";
 
 static struct argp_option options[] = {
 	{"debug", 'd', 0, 0, "Show debug output" },
+	{"debug-info", 'g', "POLICY", 0,
+	 "Keep or compress (compress=zlib or compress=zstd) the debug "
+	 "sections" },
 	{ 0 }
 };
 
@@ -114,6 +118,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		case 'd':
 			arguments->debug = 1;
 			break;
+		case 'g':
+			arguments->debug_info = kpatch_parse_debug_info(arg);
+			/* the sections are stripped or split by livepatch-link */
+			if (arguments->debug_info != DEBUG_INFO_KEEP &&
+			    arguments->debug_info != DEBUG_INFO_ZLIB &&
+			    arguments->debug_info != DEBUG_INFO_ZSTD)
+				argp_error(state, "invalid debug info policy %s",
+					   arg);
+			break;
 		case ARGP_KEY_ARG:
 			if (state->arg_num >= 3)
 				/* Too many arguments. */
@@ -141,6 +154,7 @@ int main(int argc, char *argv[])
 	struct section *sec, *symtab;
 
 	arguments.debug = 0;
+	arguments.debug_info = DEBUG_INFO_KEEP;
 	argp_parse (&argp, argc, argv, 0, 0, &arguments);
 	if (arguments.debug)
 		loglevel = DEBUG;
@@ -151,6 +165,9 @@ int main(int argc, char *argv[])
 
 	log_debug("Open elf\n");
 	kelf = kpatch_elf_open(arguments.args[0]);
+	/* every section is written back out, so load the deferred ones */
+	list_for_each_entry(sec, &kelf->sections, list)
+		kpatch_elf_load_section(kelf, sec);
 
 	/* create symbol lookup table */
 	log_debug("Lookup xen-syms\n");
@@ -184,7 +201,8 @@ int main(int argc, char *argv[])
 	kpatch_dump_kelf(kelf);
 
 	log_debug("Write out elf\n");
-	kpatch_write_output_elf(kelf, kelf->elf, arguments.args[1]);
+	kpatch_write_output_elf(kelf, arguments.args[1],
+			kpatch_debug_info_compression(arguments.debug_info));
 
 	log_debug("Elf teardown\n");
 	kpatch_elf_teardown(kelf);
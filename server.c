@@ -0,0 +1,488 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Unix socket transport for running a tool's requests in a long-running
+ * server, see server.h.
+ *
+ * A request is a struct request_hdr followed by the client's working
+ * directory and arguments as NUL-terminated strings.  The client's stdout
+ * and stderr are passed with SCM_RIGHTS along with the header.  The reply
+ * is a single int32_t: the exit status of the request, or -1 if the server
+ * refused it because it is running a different build of the tool.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "server.h"
+
+#define ERROR(format, ...) \
+	error(1, errno, "%s: %d: " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+
+/* How long a client may take to send its request */
+#define REQUEST_TIMEOUT 5
+
+struct request_hdr {
+	uint32_t size;
+	/* identity of the client's executable */
+	uint64_t exe_dev;
+	uint64_t exe_ino;
+	int64_t exe_mtime;
+};
+
+struct request {
+	struct list_head list;
+	pid_t pid;
+	int fd;
+	char *buf;
+	int argc;
+	char **argv;
+};
+
+static LIST_HEAD(requests);
+static const char *socket_path;
+static int sigchld_pipe[2];
+
+static void exe_identity(struct request_hdr *hdr)
+{
+	struct stat st;
+
+	if (stat("/proc/self/exe", &st))
+		ERROR("stat /proc/self/exe");
+	hdr->exe_dev = st.st_dev;
+	hdr->exe_ino = st.st_ino;
+	hdr->exe_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -1;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int read_full(int fd, void *buf, size_t size)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (size) {
+		n = read(fd, p, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (size) {
+		n = write(fd, p, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Send the header along with stdout and stderr, then the rest */
+static int send_request(int fd, struct request_hdr *hdr, char *buf)
+{
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	do {
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1)
+		return -1;
+	if (n < sizeof(*hdr) &&
+	    write_full(fd, (char *)hdr + n, sizeof(*hdr) - n))
+		return -1;
+
+	return write_full(fd, buf, hdr->size);
+}
+
+int server_request(const char *path, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct request_hdr hdr;
+	char cwd[PATH_MAX], *buf, *p;
+	int32_t status;
+	int fd, i;
+	void (*sigpipe)(int);
+
+	if (socket_address(path, &addr))
+		return -1;
+	if (!getcwd(cwd, sizeof(cwd)))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		ERROR("socket");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	exe_identity(&hdr);
+	hdr.size = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		hdr.size += strlen(argv[i]) + 1;
+
+	p = buf = malloc(hdr.size);
+	if (!buf)
+		ERROR("malloc");
+	p = stpcpy(p, cwd) + 1;
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	/* a server which went away is the same as no server */
+	sigpipe = signal(SIGPIPE, SIG_IGN);
+	if (send_request(fd, &hdr, buf) ||
+	    read_full(fd, &status, sizeof(status)))
+		status = -1;
+	signal(SIGPIPE, sigpipe);
+
+	free(buf);
+	close(fd);
+
+	return status;
+}
+
+static void sigchld_handler(int sig)
+{
+	int saved_errno = errno;
+
+	if (write(sigchld_pipe[1], "", 1) == -1) {
+		/* the pipe is already non-empty */
+	}
+	errno = saved_errno;
+}
+
+static void sigterm_handler(int sig)
+{
+	unlink(socket_path);
+	_exit(0);
+}
+
+/* Read a request, returns NULL if it is malformed */
+static struct request *receive_request(int fd, int fds[2])
+{
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct request_hdr hdr, self;
+	struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT };
+	struct request *req;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *p, *end;
+	int i;
+	ssize_t n;
+
+	fds[0] = fds[1] = -1;
+
+	/* a client which stalls must not hold up the others */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+		return NULL;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (n == -1 && errno == EINTR);
+	if (n <= 0)
+		return NULL;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+		memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+	if (fds[0] == -1 || fds[1] == -1)
+		return NULL;
+
+	if (n < sizeof(hdr) &&
+	    read_full(fd, (char *)&hdr + n, sizeof(hdr) - n))
+		return NULL;
+
+	exe_identity(&self);
+	if (hdr.exe_dev != self.exe_dev || hdr.exe_ino != self.exe_ino ||
+	    hdr.exe_mtime != self.exe_mtime) {
+		int32_t refused = -1;
+
+		fprintf(stderr, "refusing request from a different build\n");
+		write_full(fd, &refused, sizeof(refused));
+		return NULL;
+	}
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		ERROR("malloc");
+	memset(req, 0, sizeof(*req));
+	req->fd = fd;
+	req->buf = malloc(hdr.size + 1);
+	if (!req->buf)
+		ERROR("malloc");
+	if (read_full(fd, req->buf, hdr.size))
+		goto err;
+	req->buf[hdr.size] = '\0';
+
+	/* the working directory, then the arguments */
+	end = req->buf + hdr.size;
+	for (p = req->buf; p < end; p += strlen(p) + 1)
+		req->argc++;
+	req->argc--;
+	if (req->argc < 1)
+		goto err;
+	req->argv = malloc((req->argc + 1) * sizeof(*req->argv));
+	if (!req->argv)
+		ERROR("malloc");
+	p = req->buf + strlen(req->buf) + 1;
+	for (i = 0; i < req->argc; i++, p += strlen(p) + 1)
+		req->argv[i] = p;
+	req->argv[i] = NULL;
+
+	return req;
+
+err:
+	free(req->argv);
+	free(req->buf);
+	free(req);
+	return NULL;
+}
+
+static void free_request(struct request *req)
+{
+	close(req->fd);
+	free(req->argv);
+	free(req->buf);
+	free(req);
+}
+
+static void start_request(int listenfd, int fd, struct server_ops *ops)
+{
+	struct request *req, *other;
+	int fds[2];
+
+	req = receive_request(fd, fds);
+	if (!req) {
+		if (fds[0] != -1)
+			close(fds[0]);
+		if (fds[1] != -1)
+			close(fds[1]);
+		close(fd);
+		return;
+	}
+
+	req->pid = fork();
+	if (req->pid == -1)
+		ERROR("fork");
+	if (!req->pid) {
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		close(listenfd);
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+		close(fd);
+		/* don't hold on to the connections of other clients */
+		list_for_each_entry(other, &requests, list)
+			close(other->fd);
+
+		if (dup2(fds[0], STDOUT_FILENO) == -1 ||
+		    dup2(fds[1], STDERR_FILENO) == -1)
+			_exit(1);
+		close(fds[0]);
+		close(fds[1]);
+		if (chdir(req->buf))
+			error(1, errno, "chdir %s", req->buf);
+
+		exit(ops->run(req->argc, req->argv));
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	list_add_tail(&req->list, &requests);
+}
+
+static void reap_requests(struct server_ops *ops)
+{
+	struct request *req, *safe;
+	int32_t status;
+	int wstatus;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+		list_for_each_entry_safe(req, safe, &requests, list) {
+			if (req->pid != pid)
+				continue;
+
+			/* the same status the shell would report */
+			if (WIFSIGNALED(wstatus))
+				status = 128 + WTERMSIG(wstatus);
+			else
+				status = WEXITSTATUS(wstatus);
+			write_full(req->fd, &status, sizeof(status));
+
+			list_del(&req->list);
+			ops->done(req->buf, req->argc, req->argv, status);
+			free_request(req);
+			break;
+		}
+	}
+}
+
+void server_run(const char *path, struct server_ops *ops)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfds[2];
+	struct sigaction sa;
+	mode_t mask;
+	int listenfd, fd;
+	char c;
+
+	if (socket_address(path, &addr))
+		error(1, 0, "socket path too long: %s", path);
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenfd == -1)
+		ERROR("socket");
+
+	/* replace a stale socket, but not a live server */
+	if (!connect(listenfd, (struct sockaddr *)&addr, sizeof(addr)))
+		error(1, 0, "a server is already listening on %s", path);
+	close(listenfd);
+	unlink(path);
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenfd == -1)
+		ERROR("socket");
+	mask = umask(077);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)))
+		ERROR("bind %s", path);
+	umask(mask);
+	if (listen(listenfd, 64))
+		ERROR("listen");
+	socket_path = path;
+
+	if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK))
+		ERROR("pipe2");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	sa.sa_handler = sigterm_handler;
+	sa.sa_flags = 0;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on %s\n", path);
+	fflush(stdout);
+
+	pfds[0].fd = listenfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sigchld_pipe[0];
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			ERROR("poll");
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			while (read(sigchld_pipe[0], &c, 1) == 1)
+				;
+			reap_requests(ops);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd == -1) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				ERROR("accept4");
+			}
+			start_request(listenfd, fd, ops);
+		}
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+/*
+ * A tool can serve its own command line over a Unix socket, so that state
+ * it has loaded once is kept warm across runs.  Each request carries the
+ * client's working directory, its arguments and its stdout and stderr, and
+ * is run in a child forked from the server.  The child's exit status is
+ * returned to the client as its own.
+ */
+struct server_ops {
+	/* Run a request, in the forked child.  Returns the exit status. */
+	int (*run)(int argc, char *argv[]);
+	/* Called in the server once a request has finished */
+	void (*done)(const char *cwd, int argc, char *argv[], int status);
+};
+
+/*
+ * Run argv through the server listening on path.  Returns the exit status,
+ * or -1 if there is no usable server and the request must be run locally.
+ */
+int server_request(const char *path, int argc, char *argv[]);
+
+/* Serve requests on path until killed */
+void server_run(const char *path, struct server_ops *ops);
+
+#endif /* _SERVER_H_ */
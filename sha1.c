@@ -0,0 +1,132 @@
+/*
+ * SHA-1, as specified in FIPS 180-4.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+#define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(struct sha1_ctx *ctx, const unsigned char *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+		       (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for (; i < 80; i++)
+		w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol(b, 30);
+		b = a;
+		a = t;
+	}
+
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xc3d2e1f0;
+	ctx->len = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t used = ctx->len % 64, n;
+
+	ctx->len += len;
+
+	if (used) {
+		n = 64 - used;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha1_block(ctx, ctx->buf);
+	}
+
+	for (; len >= 64; p += 64, len -= 64)
+		sha1_block(ctx, p);
+
+	memcpy(ctx->buf, p, len);
+}
+
+void sha1_final(struct sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+	uint64_t bits = ctx->len * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t padlen;
+	int i;
+
+	padlen = (ctx->len % 64 < 56 ? 56 : 120) - ctx->len % 64;
+	for (i = 0; i < 8; i++)
+		pad[padlen + i] = bits >> (56 - i * 8);
+	sha1_update(ctx, pad, padlen + 8);
+
+	for (i = 0; i < 20; i++)
+		digest[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+void sha1_hex(const unsigned char digest[SHA1_DIGEST_SIZE],
+	      char hex[SHA1_DIGEST_SIZE * 2 + 1])
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xf];
+	}
+	hex[SHA1_DIGEST_SIZE * 2] = '\0';
+}
@@ -0,0 +1,21 @@
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+struct sha1_ctx {
+	uint32_t h[5];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_SIZE]);
+void sha1_hex(const unsigned char digest[SHA1_DIGEST_SIZE],
+	      char hex[SHA1_DIGEST_SIZE * 2 + 1]);
+
+#endif /* _SHA1_H_ */